@@ -33,15 +33,53 @@ LIBS += /usr/local/opt/opencv@2/lib/libopencv_core.dylib \
 LIBS += -L/usr/local/opt/opencv@2/lib  -lopencv_core -lopencv_imgproc -lopencv_highgui -lopencv_ml -lopencv_contrib -lopencv_calib3d
 LIBS += -L/usr/local/opt/opencv@2/lib -lopencv_features2d -lopencv_video -lopencv_objdetect  -lopencv_legacy -lopencv_flann -lopencv_gpu
 
+# Pass-through recording copies the compressed stream with FFmpeg, enable it with: qmake CONFIG+=ffmpeg
+ffmpeg {
+    DEFINES += USE_FFMPEG=1
+    INCLUDEPATH += /usr/local/opt/ffmpeg/include/
+    LIBS += -L/usr/local/opt/ffmpeg/lib -lavformat -lavcodec -lavutil
+}
+
+# The stabilizer kernels use the vector instructions of the building machine, enable it with: qmake CONFIG+=native
+native {
+    QMAKE_CXXFLAGS += -march=native
+}
+
 SOURCES += src/main.cpp \
     src/OpenCVWidget.cpp \
     src/OverlayData.cpp \
-    src/videoStabilizer.cc
+    src/videoStabilizer.cc \
+    src/VideoCaptureThread.cpp \
+    src/FrameRing.cpp \
+    src/FramePool.cpp \
+    src/FrameScheduler.cpp \
+    src/StreamWorkerPool.cpp \
+    src/VideoGridWidget.cpp \
+    src/VideoRecorder.cpp \
+    src/StreamRemuxer.cpp \
+    src/RecordingSegments.cpp \
+    src/PreEventBuffer.cpp \
+    src/TelemetryLog.cpp \
+    src/SeekIndex.cpp
 
 HEADERS  += \
     src/OpenCVWidget.h \
     src/OverlayData.h \
-    src/videoStabilizer.h
+    src/videoStabilizer.h \
+    src/VideoCaptureThread.h \
+    src/FrameDescriptor.h \
+    src/FrameRing.h \
+    src/FramePool.h \
+    src/FrameScheduler.h \
+    src/StreamWorkerPool.h \
+    src/VideoGridWidget.h \
+    src/VideoRecorder.h \
+    src/StreamRemuxer.h \
+    src/RecordingSegments.h \
+    src/PreEventBuffer.h \
+    src/TelemetryLog.h \
+    src/SeekIndex.h \
+    src/GrayCodeKernels.h
 
 FORMS    += \
     src/OpenCVWidget.ui
@@ -0,0 +1,68 @@
+#ifndef FRAMEDESCRIPTOR_H
+#define FRAMEDESCRIPTOR_H
+
+#include <QtGlobal>
+
+#include "opencv2/core/core.hpp"
+
+/**
+ * @brief A decoded frame with the identity it keeps through the whole pipeline.
+ *
+ * All times are in milliseconds on the monotonic clock of the capture thread, so every
+ * stage can stamp when it finished with the frame and compute its own latency.
+**/
+struct FrameDescriptor
+{
+    /** @brief Stages of the pipeline a frame goes through */
+    enum Stage
+    {
+        Captured = 0,
+        Stabilized,
+        Tracked,
+        Displayed,
+        Recorded,
+        StageCount
+    };
+
+    FrameDescriptor()
+        : sequence(0),
+        captureTime(0),
+        streamPosition(-1.0)
+    {
+        for(int i = 0; i < StageCount; i++)
+        {
+            stageTimes[i] = -1;
+        }
+    }
+
+    /** @brief Stamps the time a stage finished with the frame */
+    void markStage(Stage stage, qint64 time)
+    {
+        stageTimes[stage] = time;
+    }
+
+    /** @brief Return the time from the capture until a stage finished, -1 if the stage was not reached */
+    qint64 latency(Stage stage) const
+    {
+        return stageTimes[stage] < 0 ? -1 : stageTimes[stage] - captureTime;
+    }
+
+    /** @brief Return true if the descriptor holds a frame */
+    bool isValid() const
+    {
+        return !image.empty();
+    }
+
+    /** Pixels of the frame */
+    cv::Mat image;
+    /** Number of the frame since the source was opened, gaps are frames dropped on the way */
+    quint64 sequence;
+    /** Time when the frame was grabbed */
+    qint64 captureTime;
+    /** Position of the frame in the stream in milliseconds, -1 if the source gives none */
+    double streamPosition;
+    /** Time when each stage finished with the frame, -1 if not reached */
+    qint64 stageTimes[StageCount];
+};
+
+#endif // FRAMEDESCRIPTOR_H
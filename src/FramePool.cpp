@@ -0,0 +1,89 @@
+#include "FramePool.h"
+
+FramePool::FramePool(int initialBuffers, int maximumBuffers)
+    : initialBuffers(initialBuffers),
+    maximumBuffers(qMax(initialBuffers, maximumBuffers))
+{
+    bufferType = 0;
+    nextBuffer = 0;
+    reused = 0;
+    allocated = 0;
+}
+
+void FramePool::reset(const cv::Size& size, int type)
+{
+    clear();
+
+    bufferSize = size;
+    bufferType = type;
+
+    if(size.area() <= 0)
+        return;
+
+    for(int i = 0; i < initialBuffers; i++)
+    {
+        buffers.append(cv::Mat(size, type));
+    }
+}
+
+cv::Mat FramePool::acquire()
+{
+    // Round robin, so a buffer released just now is the last one to be reused
+    for(int i = 0; i < buffers.size(); i++)
+    {
+        int index = (nextBuffer + i) % buffers.size();
+
+        if(isUnused(buffers[index]))
+        {
+            nextBuffer = (index + 1) % buffers.size();
+            reused++;
+            return buffers[index];
+        }
+    }
+
+    allocated++;
+
+    if(bufferSize.area() <= 0)
+        return cv::Mat();
+
+    if(buffers.size() < maximumBuffers)
+    {
+        buffers.append(cv::Mat(bufferSize, bufferType));
+        return buffers.last();
+    }
+
+    return cv::Mat(bufferSize, bufferType);
+}
+
+void FramePool::clear()
+{
+    buffers.clear();
+    nextBuffer = 0;
+    reused = 0;
+    allocated = 0;
+}
+
+int FramePool::size() const
+{
+    return buffers.size();
+}
+
+quint64 FramePool::reusedBuffers() const
+{
+    return reused;
+}
+
+quint64 FramePool::allocatedBuffers() const
+{
+    return allocated;
+}
+
+bool FramePool::isUnused(cv::Mat& buffer)
+{
+    // Other threads release their references concurrently, so read the counter atomically
+#if CV_MAJOR_VERSION >= 3
+    return buffer.u != NULL && CV_XADD(&buffer.u->refcount, 0) == 1;
+#else
+    return buffer.refcount != NULL && CV_XADD(buffer.refcount, 0) == 1;
+#endif
+}
@@ -0,0 +1,65 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <QVector>
+
+#include "opencv2/core/core.hpp"
+
+/**
+ * @brief Set of preallocated frame buffers recycled by the capture thread.
+ *
+ * A buffer is handed out again only when no other cv::Mat references it, so frames that
+ * are still queued, displayed or recorded are never overwritten. Only the producer thread
+ * may call acquire() and reset().
+**/
+class FramePool
+{
+public:
+    /**
+     * @brief This is the class constructor.
+     *
+     * @param  initialBuffers   Number of buffers preallocated by reset()
+     * @param  maximumBuffers   Number of buffers the pool may grow to
+    **/
+    FramePool(int initialBuffers = 8, int maximumBuffers = 16);
+
+    /**
+     * @brief Drops the current buffers and preallocates new ones.
+     *
+     * @param size Size of the frames of the stream
+     * @param type OpenCV type of the frames of the stream
+     **/
+    void reset(const cv::Size& size, int type);
+    /**
+     * @brief Return a buffer not referenced outside the pool. If every buffer is in use the pool
+     * grows, and once it reached its maximum an unpooled buffer is allocated.
+     **/
+    cv::Mat acquire();
+    /** @brief Drops all buffers */
+    void clear();
+
+    /** @brief Return the number of buffers owned by the pool */
+    int size() const;
+    /** @brief Return the number of times acquire() returned a recycled buffer */
+    quint64 reusedBuffers() const;
+    /** @brief Return the number of buffers allocated by acquire() after reset() */
+    quint64 allocatedBuffers() const;
+
+private:
+    /** @brief Return true if only the pool references the buffer */
+    static bool isUnused(cv::Mat& buffer);
+
+    const int initialBuffers;
+    const int maximumBuffers;
+
+    QVector<cv::Mat> buffers;
+    cv::Size bufferSize;
+    int bufferType;
+    /** Index where the search for an unused buffer starts */
+    int nextBuffer;
+
+    quint64 reused;
+    quint64 allocated;
+};
+
+#endif // FRAMEPOOL_H
@@ -0,0 +1,172 @@
+#include "FrameRing.h"
+
+/** @brief Rounds value up to the next power of two */
+static int nextPowerOfTwo(int value)
+{
+    int power = 1;
+
+    while(power < value)
+    {
+        power <<= 1;
+    }
+
+    return power;
+}
+
+FrameRing::FrameRing(int capacity)
+    : ringCapacity(nextPowerOfTwo(qMax(capacity, 1))),
+    ringMask(ringCapacity - 1),
+    buffers(2*ringCapacity + 2),
+    queue(ringCapacity),
+    freeSlots(nextPowerOfTwo(2*ringCapacity + 2)),
+    freeMask(freeSlots.size() - 1),
+    claimed(ringCapacity)
+{
+    clear();
+}
+
+void FrameRing::push(const FrameDescriptor& frame)
+{
+    buffers[writeSlot] = frame;
+
+    uint h = head.load();
+    int recycled = -1;
+
+    forever
+    {
+        uint t = tail.loadAcquire();
+
+        if(h - t < (uint)ringCapacity)
+            break;
+
+        // Full, take the oldest frame back unless the consumer claims it first
+        if(tail.testAndSetOrdered(t, t + 1))
+        {
+            recycled = queue[t & ringMask].load();
+            buffers[recycled].image.release();
+            dropped.fetchAndAddRelaxed(1);
+            break;
+        }
+    }
+
+    queue[h & ringMask].store(writeSlot);
+    head.storeRelease(h + 1);
+    produced.fetchAndAddRelaxed(1);
+
+    writeSlot = recycled >= 0 ? recycled : acquireSlot();
+}
+
+bool FrameRing::popLatest(FrameDescriptor& frame)
+{
+    uint count;
+
+    forever
+    {
+        uint t = tail.loadAcquire();
+        uint h = head.loadAcquire();
+
+        if(t == h)
+            return false;
+
+        count = h - t;
+
+        // The producer lapped us between both loads
+        if(count > (uint)ringCapacity)
+            continue;
+
+        // Read the indices before claiming them, once tail moves they may be overwritten
+        for(uint i = 0; i < count; i++)
+        {
+            claimed[i] = queue[(t + i) & ringMask].load();
+        }
+
+        if(tail.testAndSetOrdered(t, h))
+            break;
+    }
+
+    frame = buffers[claimed[count - 1]];
+
+    consumed.fetchAndAddRelaxed(1);
+    dropped.fetchAndAddRelaxed(count - 1);
+
+    for(uint i = 0; i < count; i++)
+    {
+        buffers[claimed[i]].image.release();
+        releaseSlot(claimed[i]);
+    }
+
+    return true;
+}
+
+void FrameRing::clear()
+{
+    for(int i = 0; i < buffers.size(); i++)
+    {
+        buffers[i].image.release();
+    }
+
+    head.store(0);
+    tail.store(0);
+
+    // The producer keeps slot 0, every other slot starts released
+    writeSlot = 0;
+    freeHead.store(0);
+    freeTail.store(0);
+
+    for(int i = 1; i < buffers.size(); i++)
+    {
+        releaseSlot(i);
+    }
+
+    produced.store(0);
+    consumed.store(0);
+    dropped.store(0);
+}
+
+void FrameRing::releaseSlot(int slot)
+{
+    uint h = freeHead.load();
+    freeSlots[h & freeMask].store(slot);
+    freeHead.storeRelease(h + 1);
+}
+
+int FrameRing::acquireSlot()
+{
+    uint t = freeTail.load();
+
+    if(t == (uint)freeHead.loadAcquire())
+        return -1;
+
+    int slot = freeSlots[t & freeMask].load();
+    freeTail.storeRelease(t + 1);
+
+    return slot;
+}
+
+int FrameRing::depth() const
+{
+    uint t = tail.loadAcquire();
+    uint h = head.loadAcquire();
+
+    return qMin(h - t, (uint)ringCapacity);
+}
+
+int FrameRing::capacity() const
+{
+    return ringCapacity;
+}
+
+quint64 FrameRing::producedFrames() const
+{
+    return produced.load();
+}
+
+quint64 FrameRing::consumedFrames() const
+{
+    return consumed.load();
+}
+
+quint64 FrameRing::droppedFrames() const
+{
+    return dropped.load();
+}
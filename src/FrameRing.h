@@ -0,0 +1,93 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <QVector>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+
+#include "opencv2/core/core.hpp"
+
+#include "FrameDescriptor.h"
+
+/**
+ * @brief Bounded lock-free frame queue between one producer and one consumer.
+ *
+ * The queue stores indices into a fixed set of slots, so a slot is only ever touched by
+ * the thread that owns its index. When the queue is full the producer drops the oldest
+ * queued frame, and the consumer always takes the newest frame, dropping older ones.
+ * The capacity is rounded up to a power of two.
+**/
+class FrameRing
+{
+public:
+    /**
+     * @brief This is the class constructor.
+     *
+     * @param  capacity Maximum number of queued frames
+    **/
+    FrameRing(int capacity = 4);
+
+    /**
+     * @brief Queues a frame, dropping the oldest queued frame if full. Producer only.
+     *
+     * @param frame The frame to queue, the pixel data is shared not copied
+     **/
+    void push(const FrameDescriptor& frame);
+    /**
+     * @brief Takes the newest queued frame and drops the older ones. Consumer only.
+     *
+     * @param frame Receives the newest frame
+     * @return True if a frame was queued
+     **/
+    bool popLatest(FrameDescriptor& frame);
+    /** @brief Empties the queue and resets the counters. Neither side may be running. */
+    void clear();
+
+    /** @brief Return the number of frames waiting in the queue */
+    int depth() const;
+    /** @brief Return the maximum number of queued frames */
+    int capacity() const;
+    /** @brief Return the number of frames queued since the last clear() */
+    quint64 producedFrames() const;
+    /** @brief Return the number of frames taken since the last clear() */
+    quint64 consumedFrames() const;
+    /** @brief Return the number of frames dropped since the last clear() */
+    quint64 droppedFrames() const;
+
+private:
+    Q_DISABLE_COPY(FrameRing)
+
+    /** @brief Returns a slot index to the producer */
+    void releaseSlot(int slot);
+    /** @brief Takes a released slot index, -1 if there is none */
+    int acquireSlot();
+
+    const int ringCapacity;
+    const uint ringMask;
+
+    /** Frame storage, enough for the queue, the slots in transit and the producer */
+    QVector<FrameDescriptor> buffers;
+
+    /** Queue of slot indices, written by the producer */
+    QVector<QAtomicInt> queue;
+    QAtomicInt head;
+    QAtomicInt tail;
+
+    /** Queue of released slot indices, written by the consumer */
+    QVector<QAtomicInt> freeSlots;
+    const uint freeMask;
+    QAtomicInt freeHead;
+    QAtomicInt freeTail;
+
+    /** Slot owned by the producer */
+    int writeSlot;
+    /** Slot indices claimed by the consumer */
+    QVector<int> claimed;
+
+    /** 64 bits, a long stream would wrap a 32 bit count */
+    QAtomicInteger<quint64> produced;
+    QAtomicInteger<quint64> consumed;
+    QAtomicInteger<quint64> dropped;
+};
+
+#endif // FRAMERING_H
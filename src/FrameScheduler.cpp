@@ -0,0 +1,146 @@
+#include "FrameScheduler.h"
+
+#include <QtGlobal>
+
+const double FrameScheduler::smoothing = 1.0/16.0;
+const int FrameScheduler::minimumInterval;
+const int FrameScheduler::maximumInterval;
+
+FrameScheduler::FrameScheduler(int defaultInterval, int latencyTarget)
+    : defaultInterval(defaultInterval),
+    latencyTarget(latencyTarget)
+{
+    reset(0.0);
+}
+
+void FrameScheduler::reset(double nominalFps)
+{
+    QMutexLocker locker(&mutex);
+
+    sourceAverage = nominalFps > 0.0 ? 1000.0/nominalFps : 0.0;
+    hasSourceTime = false;
+    lastSourceTime = 0;
+
+    displayAverage = 0.0;
+    jitterAverage = 0.0;
+    hasDisplayTime = false;
+    lastDisplayTime = 0;
+
+    latencyAverage = 0.0;
+    latencyMaximum = 0;
+    latencyOverTarget = 0;
+}
+
+void FrameScheduler::sourceFrame(qint64 timestampMs)
+{
+    QMutexLocker locker(&mutex);
+
+    if(hasSourceTime)
+    {
+        qint64 delta = timestampMs - lastSourceTime;
+
+        // Seeks, stalls and reconnections do not tell anything about the rate
+        if(delta > 0 && (sourceAverage <= 0.0 || delta < maximumPeriods*sourceAverage))
+        {
+            sourceAverage = average(sourceAverage, delta);
+        }
+    }
+
+    lastSourceTime = timestampMs;
+    hasSourceTime = true;
+}
+
+void FrameScheduler::frameDisplayed(qint64 timeMs, qint64 captureTimeMs)
+{
+    QMutexLocker locker(&mutex);
+
+    qint64 latency = timeMs - captureTimeMs;
+    latencyAverage = average(latencyAverage, latency);
+    latencyMaximum = qMax(latencyMaximum, latency);
+
+    if(latency > latencyTarget)
+    {
+        latencyOverTarget++;
+    }
+
+    if(hasDisplayTime)
+    {
+        qint64 delta = timeMs - lastDisplayTime;
+
+        if(delta > 0)
+        {
+            displayAverage = average(displayAverage, delta);
+            jitterAverage = average(jitterAverage, qAbs(delta - displayAverage));
+        }
+    }
+
+    lastDisplayTime = timeMs;
+    hasDisplayTime = true;
+}
+
+void FrameScheduler::setLatencyTarget(int targetMs)
+{
+    QMutexLocker locker(&mutex);
+    latencyTarget = targetMs;
+}
+
+int FrameScheduler::interval() const
+{
+    QMutexLocker locker(&mutex);
+
+    if(sourceAverage <= 0.0)
+        return defaultInterval;
+
+    // Look twice per source period, so a new frame waits at most half a period
+    return qBound(minimumInterval, qRound(sourceAverage/2.0), maximumInterval);
+}
+
+double FrameScheduler::sourcePeriod() const
+{
+    QMutexLocker locker(&mutex);
+    return sourceAverage;
+}
+
+double FrameScheduler::sourceFps() const
+{
+    QMutexLocker locker(&mutex);
+    return sourceAverage > 0.0 ? 1000.0/sourceAverage : 0.0;
+}
+
+double FrameScheduler::displayFps() const
+{
+    QMutexLocker locker(&mutex);
+    return displayAverage > 0.0 ? 1000.0/displayAverage : 0.0;
+}
+
+double FrameScheduler::displayJitter() const
+{
+    QMutexLocker locker(&mutex);
+    return jitterAverage;
+}
+
+double FrameScheduler::averageLatency() const
+{
+    QMutexLocker locker(&mutex);
+    return latencyAverage;
+}
+
+qint64 FrameScheduler::maximumLatency() const
+{
+    QMutexLocker locker(&mutex);
+    return latencyMaximum;
+}
+
+quint64 FrameScheduler::framesOverLatencyTarget() const
+{
+    QMutexLocker locker(&mutex);
+    return latencyOverTarget;
+}
+
+double FrameScheduler::average(double current, double sample)
+{
+    if(current <= 0.0)
+        return sample;
+
+    return current + smoothing*(sample - current);
+}
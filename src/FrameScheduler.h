@@ -0,0 +1,97 @@
+#ifndef FRAMESCHEDULER_H
+#define FRAMESCHEDULER_H
+
+#include <QMutex>
+
+/**
+ * @brief Estimates the frame rate of the source from its timestamps and paces the display from it.
+ *
+ * The capture thread reports the timestamp of each decoded frame and the display reports each
+ * frame it shows. The source period is a moving average of the timestamp deltas, so it follows
+ * drifting sources, and discontinuities such as seeks or stalls are ignored.
+**/
+class FrameScheduler
+{
+public:
+    /**
+     * @brief This is the class constructor.
+     *
+     * @param  defaultInterval  Display interval in milliseconds used while the source rate is unknown
+     * @param  latencyTarget    Capture to display latency in milliseconds the frames should stay under
+    **/
+    FrameScheduler(int defaultInterval = 40, int latencyTarget = 200);
+
+    /**
+     * @brief Forgets the estimations of a previous source.
+     *
+     * @param nominalFps Frame rate reported by the new source, 0 if unknown
+     **/
+    void reset(double nominalFps);
+    /**
+     * @brief Reports a frame decoded from the source. Can be called from the capture thread.
+     *
+     * @param timestampMs Stream timestamp of the frame, or its arrival time for live sources
+     **/
+    void sourceFrame(qint64 timestampMs);
+    /**
+     * @brief Reports a new frame shown on the display.
+     *
+     * @param timeMs        Time when the frame was shown
+     * @param captureTimeMs Time when the frame was captured, on the same clock as timeMs
+     **/
+    void frameDisplayed(qint64 timeMs, qint64 captureTimeMs);
+    /**
+     * @brief Sets the capture to display latency the frames should stay under.
+     *
+     * @param targetMs Latency target in milliseconds
+     **/
+    void setLatencyTarget(int targetMs);
+
+    /** @brief Return the interval in milliseconds at which the display should look for new frames */
+    int interval() const;
+    /** @brief Return the estimated period of the source in milliseconds, 0 if unknown */
+    double sourcePeriod() const;
+    /** @brief Return the estimated frame rate of the source */
+    double sourceFps() const;
+    /** @brief Return the frame rate achieved by the display */
+    double displayFps() const;
+    /** @brief Return the average deviation in milliseconds of the display intervals from their mean */
+    double displayJitter() const;
+    /** @brief Return the average capture to display latency in milliseconds */
+    double averageLatency() const;
+    /** @brief Return the largest capture to display latency in milliseconds */
+    qint64 maximumLatency() const;
+    /** @brief Return the number of frames shown later than the latency target */
+    quint64 framesOverLatencyTarget() const;
+
+private:
+    /** Weight of a new sample in the moving averages */
+    static const double smoothing;
+    /** Deltas larger than this many periods are taken as discontinuities */
+    static const int maximumPeriods = 4;
+    /** Bounds of the display interval in milliseconds */
+    static const int minimumInterval = 5;
+    static const int maximumInterval = 500;
+
+    /** @brief Updates a moving average, the first sample initializes it */
+    static double average(double current, double sample);
+
+    mutable QMutex mutex;
+    const int defaultInterval;
+
+    double sourceAverage;
+    qint64 lastSourceTime;
+    bool hasSourceTime;
+
+    double displayAverage;
+    double jitterAverage;
+    qint64 lastDisplayTime;
+    bool hasDisplayTime;
+
+    int latencyTarget;
+    double latencyAverage;
+    qint64 latencyMaximum;
+    quint64 latencyOverTarget;
+};
+
+#endif // FRAMESCHEDULER_H
@@ -0,0 +1,188 @@
+/**
+ * @file     GrayCodeKernels.h
+ * @brief    Bit counting kernels used by the stabilizer on gray code planes packed 64 pixels per word.
+ *
+ * The vector variants are chosen when building, enable them for the building machine with
+ * qmake CONFIG+=native. The scalar variants give the same results.
+ */
+
+#ifndef GRAYCODEKERNELS_H
+#define GRAYCODEKERNELS_H
+
+#include <QtGlobal>
+
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSSE3__) || defined(__SSE2__) || defined(__POPCNT__)
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/**
+    Return the number of set bits of a word
+
+    @param  value   The word to count
+*/
+inline uint popCount64(quint64 value)
+{
+#if defined(__POPCNT__) && defined(__x86_64__)
+    return (uint)_mm_popcnt_u64(value);
+#elif defined(__GNUC__)
+    return (uint)__builtin_popcountll(value);
+#else
+    value = value - ((value >> 1) & 0x5555555555555555ULL);
+    value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+    value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (uint)((value*0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/**
+    Return 64 bits of a packed row, bit i of the result is the pixel at bit + i
+
+    @param  row     The packed row, it must have one word after the last bit read
+    @param  bit     The first pixel
+*/
+inline quint64 extractBits64(const quint64* row, uint bit)
+{
+    const quint64* word = row + (bit >> 6);
+    uint shift = bit & 63;
+
+    return shift == 0 ? word[0] : (word[0] >> shift) | (word[1] << (64 - shift));
+}
+
+/**
+    Return the mask of the pixels of a window in one of its words
+
+    @param  width   The width of the window in pixels
+    @param  word    The word of the window
+*/
+inline quint64 windowMask(uint width, uint word)
+{
+    uint bits = width - 64*word;
+
+    return bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+}
+
+/**
+    Return the number of different bits of two arrays of words, the match cost of two windows
+
+    @param  a, b    The words of the windows
+    @param  count   The number of words
+*/
+inline uint hammingDistance(const quint64* a, const quint64* b, int count)
+{
+    uint distance = 0;
+    int i = 0;
+
+#if defined(__AVX2__)
+    // Counts the bits of each nibble with a lookup, then adds the bytes of each word
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+
+    for (; i + 4 <= count; i += 4){
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                     _mm256_loadu_si256((const __m256i*)(b + i)));
+        __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(x, low)),
+                                        _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+    }
+
+    distance += (uint)(_mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                       _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3));
+#elif defined(__SSSE3__)
+    const __m128i lookup = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m128i low = _mm_set1_epi8(0x0f);
+    __m128i total = _mm_setzero_si128();
+
+    for (; i + 2 <= count; i += 2){
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i)),
+                                  _mm_loadu_si128((const __m128i*)(b + i)));
+        __m128i bytes = _mm_add_epi8(_mm_shuffle_epi8(lookup, _mm_and_si128(x, low)),
+                                     _mm_shuffle_epi8(lookup, _mm_and_si128(_mm_srli_epi16(x, 4), low)));
+        total = _mm_add_epi64(total, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+    }
+
+    distance += (uint)(_mm_cvtsi128_si32(total) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(total, total)));
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint64x2_t total = vdupq_n_u64(0);
+
+    for (; i + 2 <= count; i += 2){
+        uint8x16_t x = vreinterpretq_u8_u64(veorq_u64(vld1q_u64((const uint64_t*)(a + i)),
+                                                      vld1q_u64((const uint64_t*)(b + i))));
+        total = vaddq_u64(total, vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vcntq_u8(x)))));
+    }
+
+    distance += (uint)(vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1));
+#endif
+
+    for (; i < count; i++){
+        distance += popCount64(a[i] ^ b[i]);
+    }
+
+    return distance;
+}
+
+/**
+    Packs the gray code bit planes First to First + Count - 1 of up to 64 pixels. Bit i of
+    words[p] is bit First + p of the gray code of pixel i, planes up to 6 are supported.
+
+    @param  pixels  The pixels
+    @param  count   The number of pixels, up to 64, the bits after them are cleared
+    @param  words   Receives one word per plane
+*/
+template <int First, int Count>
+inline void packGrayCode64(const uchar* pixels, uint count, quint64* words)
+{
+    for (int p = 0; p < Count; p++){
+        words[p] = 0;
+    }
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    // Zero pixels give zero bits, the vectors always read 64
+    uchar padded[64];
+
+    if (count < 64){
+        memset(padded, 0, sizeof(padded));
+        memcpy(padded, pixels, count);
+        pixels = padded;
+    }
+
+    // Gray code bit k is bit k of v ^ (v >> 1). Shifting 16 bit lanes only spoils bit 7 of the
+    // low bytes, then bit k is moved to the sign bit of each byte, which movemask gathers.
+#if defined(__AVX2__)
+    for (int chunk = 0; chunk < 2; chunk++){
+        __m256i v = _mm256_loadu_si256((const __m256i*)(pixels + 32*chunk));
+        __m256i gray = _mm256_xor_si256(v, _mm256_srli_epi16(v, 1));
+
+        for (int p = 0; p < Count; p++){
+            words[p] |= (quint64)(uint)_mm256_movemask_epi8(_mm256_slli_epi16(gray, 7 - (First + p))) << (32*chunk);
+        }
+    }
+#else
+    for (int chunk = 0; chunk < 4; chunk++){
+        __m128i v = _mm_loadu_si128((const __m128i*)(pixels + 16*chunk));
+        __m128i gray = _mm_xor_si128(v, _mm_srli_epi16(v, 1));
+
+        for (int p = 0; p < Count; p++){
+            words[p] |= (quint64)(uint)_mm_movemask_epi8(_mm_slli_epi16(gray, 7 - (First + p))) << (16*chunk);
+        }
+    }
+#endif
+#else
+    for (uint i = 0; i < count; i++){
+        uint gray = pixels[i] ^ (pixels[i] >> 1);
+
+        for (int p = 0; p < Count; p++){
+            words[p] |= (quint64)((gray >> (First + p)) & 1) << i;
+        }
+    }
+#endif
+}
+
+#endif // GRAYCODEKERNELS_H
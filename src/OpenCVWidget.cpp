@@ -7,7 +7,7 @@ OpenCVWidget::OpenCVWidget(QWidget *parent) :
 {
     ui->setupUi(this);
 
-    OverlayData* overlayData = new OverlayData(300, 300, this);
+    overlayData = new OverlayData(300, 300, this);
     QHBoxLayout* hlButtons = new QHBoxLayout();
     btPlay = new QPushButton(QIcon(":/imagenes/Play.png"), "", this);
     btStop = new QPushButton(QIcon(":/imagenes/Stop.png"), "", this);
@@ -58,6 +58,11 @@ OpenCVWidget::~OpenCVWidget()
     delete ui;
 }
 
+void OpenCVWidget::setWorkerPool(StreamWorkerPool* pool)
+{
+    overlayData->setWorkerPool(pool);
+}
+
 void OpenCVWidget::showCaptureImage(QImage img)
 {
     Q_UNUSED(img);    
@@ -30,9 +30,18 @@ public:
     explicit OpenCVWidget(QWidget *parent = 0);
     ~OpenCVWidget();
 
+    /**
+     * @brief Processes the video on worker threads shared with other widgets.
+     *
+     * @param pool The shared workers, NULL to process on the interface thread
+     **/
+    void setWorkerPool(StreamWorkerPool* pool);
+
 private:
     Ui::OpenCVWidget *ui;    
 
+    OverlayData* overlayData;
+
     QPushButton* btPlay;
     QPushButton* btStop;
     QPushButton* btFile;
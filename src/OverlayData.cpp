@@ -12,6 +12,30 @@ inline bool isnan(T value)
     return value != value;
 }
 
+/** @brief Processes a frame of an overlay on the shared worker pool */
+class FrameProcessingJob : public QRunnable
+{
+public:
+    FrameProcessingJob(OverlayData* overlay, const FrameDescriptor& frame)
+        : overlay(overlay),
+        frame(frame)
+    {
+    }
+
+    void run()
+    {
+        QElapsedTimer timer;
+        timer.start();
+
+        overlay->processFrame(frame);
+        overlay->getWorkerPool()->jobFinished(overlay->getStreamId(), timer.elapsed());
+    }
+
+private:
+    OverlayData* overlay;
+    FrameDescriptor frame;
+};
+
 template<typename T>
 inline bool isinf(T value)
 {
@@ -59,20 +83,36 @@ OverlayData::OverlayData(int width, int height, QWidget* parent)
     alt = 0.0;
     telemetryData = false;
     videoStabilizated = false;
+    stabilizerSearch = videoStabilizer::FullSearch;
+    stabilizerEvaluation = false;
+    stabilizerEarlyTermination = true;
+    stabilizerGrid = 0;
     videoEnabled = true;
-    video = NULL;
+    latencyTarget = 200;
+    stabilizerTime = 0.0;
+    captureThread = createCaptureThread();
     isRecord = false;
     existFileMovie = false;
+    recordSegmentDuration = defaultSegmentDuration;
+    recordSegmentSize = 0;
+    recordRetention = 0;
+    recordBackpressure = VideoRecorder::Degrade;
+    recorder = createRecorder();
+    remuxer = new StreamRemuxer(this);
+    connect(remuxer, SIGNAL(error(QString)), this, SIGNAL(emitTitle(QString)));
+    passThroughRecording = false;
+    remuxing = false;
+    setRecordSegments(defaultSegmentDuration, 0);
+    preEvent = new PreEventBuffer(this);
     pathVideo = tr("/");
     //activeUAS = NULL;
-    countSubTitle = 0;
-    isSubTitles = false;
-    startTime = -1;
-    fileSubtitles = NULL;
     urlVideo = "";
     sendTrackingVideo = false;
     videoTracking = false;
     savedAutomatic = true;
+    workerPool = NULL;
+    streamId = -1;
+    processedReady = false;
 
     setAutoFillBackground(false);
     setMinimumSize(80, 60);
@@ -87,7 +127,7 @@ OverlayData::OverlayData(int width, int height, QWidget* parent)
     fill.setColor(2, qRgb(0, 0, 0));
     fill.fill(0);
 
-    refreshTimer->setInterval(updateInterval);
+    refreshTimer->setInterval(captureThread->frameScheduler().interval());
 
     connect(refreshTimer, SIGNAL(timeout()), this, SLOT(paintTelemetry()));
 
@@ -103,6 +143,104 @@ OverlayData::OverlayData(int width, int height, QWidget* parent)
 OverlayData::~OverlayData()
 {
     refreshTimer->stop();
+    setWorkerPool(NULL);
+    closeCapture();
+}
+
+int OverlayData::getFrameQueueDepth() const
+{
+    return captureThread->frameRing().depth();
+}
+
+quint64 OverlayData::getCapturedFrames() const
+{
+    return captureThread->frameRing().producedFrames();
+}
+
+quint64 OverlayData::getDisplayedFrames() const
+{
+    return captureThread->frameRing().consumedFrames();
+}
+
+quint64 OverlayData::getDroppedFrames() const
+{
+    return captureThread->frameRing().droppedFrames();
+}
+
+double OverlayData::getSourceFps() const
+{
+    return captureThread->frameScheduler().sourceFps();
+}
+
+double OverlayData::getDisplayFps() const
+{
+    return captureThread->frameScheduler().displayFps();
+}
+
+double OverlayData::getDisplayJitter() const
+{
+    return captureThread->frameScheduler().displayJitter();
+}
+
+double OverlayData::getAverageLatency() const
+{
+    return captureThread->frameScheduler().averageLatency();
+}
+
+qint64 OverlayData::getMaximumLatency() const
+{
+    return captureThread->frameScheduler().maximumLatency();
+}
+
+quint64 OverlayData::getFramesOverLatencyTarget() const
+{
+    return captureThread->frameScheduler().framesOverLatencyTarget();
+}
+
+qint64 OverlayData::getStageLatency(FrameDescriptor::Stage stage) const
+{
+    return lastFrame.latency(stage);
+}
+
+quint64 OverlayData::getLastFrameSequence() const
+{
+    return lastFrame.sequence;
+}
+
+quint64 OverlayData::getRecordedFrames() const
+{
+    return recorder->encodedFrames();
+}
+
+quint64 OverlayData::getRecordDroppedFrames() const
+{
+    return recorder->droppedFrames();
+}
+
+quint64 OverlayData::getRecordSkippedFrames() const
+{
+    return recorder->skippedFrames();
+}
+
+int OverlayData::getRecordQueueDepth() const
+{
+    return recorder->queueDepth();
+}
+
+quint64 OverlayData::getPassThroughBytes() const
+{
+    return remuxer->writtenBytes();
+}
+
+void OverlayData::setRecordBackpressure(VideoRecorder::Backpressure policy)
+{
+    recordBackpressure = policy;
+    recorder->setBackpressure(policy);
+}
+
+quint64 OverlayData::getSkippedFrames() const
+{
+    return captureThread->skippedFrames();
 }
 
 QSize OverlayData::sizeHint() const
@@ -133,16 +271,42 @@ void OverlayData::contextMenuEvent (QContextMenuEvent* event)
     enableStabilization->setChecked(videoStabilizated);
     enableTracking->setChecked(videoTracking);
     enableSendTracking->setChecked(sendTrackingVideo);
+    enableLowLatency->setChecked(captureThread->isLowLatency());
 
     menu.addAction(enableTelemetry);
     menu.addAction(enableStabilization);
+
+    QMenu* searchMenu = menu.addMenu(tr("Busqueda de estabilizacion"));
+    searchMenu->addActions(stabilizerSearchGroup->actions());
+    searchMenu->addSeparator();
+    enableSearchEvaluation->setChecked(stabilizerEvaluation);
+    searchMenu->addAction(enableSearchEvaluation);
+    enableEarlyTermination->setChecked(stabilizerEarlyTermination);
+    searchMenu->addAction(enableEarlyTermination);
+
+    QMenu* gridMenu = menu.addMenu(tr("Cuadricula de estabilizacion"));
+    gridMenu->addActions(stabilizerGridGroup->actions());
+
     menu.addAction(enableTracking);
+    menu.addAction(enableLowLatency);
+
+    enablePreEvent->setChecked(preEvent->isEnabled());
+    menu.addAction(enablePreEvent);
+
+    if(StreamRemuxer::isAvailable())
+    {
+        enablePassThrough->setChecked(passThroughRecording);
+        menu.addAction(enablePassThrough);
+    }
 
     if(videoTracking)
     {
         menu.addAction(enableSendTracking);
     }
 
+    menu.addSeparator();
+    menu.addAction(exportSubTitlesAction);
+
     menu.exec(event->globalPos());
 }
 
@@ -158,6 +322,51 @@ void OverlayData::createActions()
     enableStabilization->setChecked(videoStabilizated);
     connect(enableStabilization, SIGNAL(triggered(bool)), this, SLOT(enableStabilizationVideo(bool)));
 
+    // Same order as videoStabilizer::SearchStrategy
+    QStringList searchNames;
+    searchNames << tr("Busqueda completa") << tr("Busqueda en tres pasos")
+                << tr("Busqueda en diamante") << tr("Busqueda jerarquica")
+                << tr("Busqueda predictiva");
+
+    stabilizerSearchGroup = new QActionGroup(this);
+    stabilizerSearchGroup->setExclusive(true);
+
+    for(int i = 0; i < searchNames.size(); i++)
+    {
+        QAction* action = stabilizerSearchGroup->addAction(searchNames.at(i));
+        action->setCheckable(true);
+        action->setChecked(i == stabilizerSearch);
+        action->setData(i);
+    }
+
+    connect(stabilizerSearchGroup, SIGNAL(triggered(QAction*)), this, SLOT(selectStabilizerSearch(QAction*)));
+
+    enableSearchEvaluation = new QAction(tr("Comparar busquedas"), this);
+    enableSearchEvaluation->setCheckable(true);
+    enableSearchEvaluation->setChecked(stabilizerEvaluation);
+    connect(enableSearchEvaluation, SIGNAL(triggered(bool)), this, SLOT(enableStabilizerEvaluation(bool)));
+
+    enableEarlyTermination = new QAction(tr("Terminacion anticipada"), this);
+    enableEarlyTermination->setCheckable(true);
+    enableEarlyTermination->setChecked(stabilizerEarlyTermination);
+    connect(enableEarlyTermination, SIGNAL(triggered(bool)), this, SLOT(enableStabilizerEarlyTermination(bool)));
+
+    stabilizerGridGroup = new QActionGroup(this);
+    stabilizerGridGroup->setExclusive(true);
+
+    for(int size = 0; size <= MAX_GRID_SIZE; size++)
+    {
+        if(size == 1)
+            continue;
+
+        QAction* action = stabilizerGridGroup->addAction(size == 0 ? tr("Automatica") : tr("%1 x %1").arg(size));
+        action->setCheckable(true);
+        action->setChecked(size == stabilizerGrid);
+        action->setData(size);
+    }
+
+    connect(stabilizerGridGroup, SIGNAL(triggered(QAction*)), this, SLOT(selectStabilizerGrid(QAction*)));
+
     enableTracking = new QAction(tr("Habilitar seguimiento de posicion"), this);
     enableTracking->setCheckable(true);
     enableTracking->setChecked(videoTracking);
@@ -167,6 +376,24 @@ void OverlayData::createActions()
     enableSendTracking->setCheckable(true);
     enableSendTracking->setChecked(sendTrackingVideo);
     connect(enableSendTracking, SIGNAL(triggered(bool)), this, SLOT(enableSendTrackingPosition(bool)));
+
+    enableLowLatency = new QAction(tr("Habilitar baja latencia RTSP"), this);
+    enableLowLatency->setCheckable(true);
+    enableLowLatency->setChecked(captureThread->isLowLatency());
+    connect(enableLowLatency, SIGNAL(triggered(bool)), this, SLOT(enableLowLatencyVideo(bool)));
+
+    enablePreEvent = new QAction(tr("Grabar segundos previos"), this);
+    enablePreEvent->setCheckable(true);
+    enablePreEvent->setChecked(preEvent->isEnabled());
+    connect(enablePreEvent, SIGNAL(triggered(bool)), this, SLOT(enablePreEventRecording(bool)));
+
+    enablePassThrough = new QAction(tr("Grabar sin recodificar"), this);
+    enablePassThrough->setCheckable(true);
+    enablePassThrough->setChecked(passThroughRecording);
+    connect(enablePassThrough, SIGNAL(triggered(bool)), this, SLOT(enablePassThroughRecording(bool)));
+
+    exportSubTitlesAction = new QAction(tr("Exportar subtitulos..."), this);
+    connect(exportSubTitlesAction, SIGNAL(triggered()), this, SLOT(exportSubTitles()));
 }
 
 float OverlayData::refToScreenX(float x)
@@ -334,104 +561,73 @@ void OverlayData::paintTelemetry()
 
         if (videoEnabled)
         {
-            if(captureVideo.isOpened())
+            if(captureThread->isOpened())
             {
-                if (video == NULL )
+                if (video.isNull())
                 {
                     QRect imageSize;
-                    imageSize.setWidth(captureVideo.get(CV_CAP_PROP_FRAME_WIDTH));
-                    imageSize.setHeight(captureVideo.get(CV_CAP_PROP_FRAME_HEIGHT));
+                    imageSize.setSize(captureThread->frameSize());
 
                     //qDebug()<<"width: "<< captureVideo.get(CV_CAP_PROP_FRAME_WIDTH);
                     //qDebug()<<"height: "<< captureVideo.get(CV_CAP_PROP_FRAME_HEIGHT);
 
-                    video = new videoStabilizer(imageSize);
-                    connect(video,SIGNAL(gotDuration(double&)), this, SLOT(updateTimeLabel(double&)));
+                    QSharedPointer<videoStabilizer> stabilizer(new videoStabilizer(imageSize), &QObject::deleteLater);
+                    stabilizer->setSubframeWorkers(workerPool == NULL);
+                    stabilizer->setSearchStrategy((videoStabilizer::SearchStrategy)stabilizerSearch);
+                    stabilizer->setSearchEvaluation(stabilizerEvaluation);
+                    stabilizer->setEarlyTermination(stabilizerEarlyTermination);
+                    stabilizer->setSubframeGrid(stabilizerGrid, stabilizerGrid);
+                    stabilizer->setParameters(stabilizerParameters);
+                    connect(stabilizer.data(),SIGNAL(gotDuration(double)), this, SLOT(updateTimeLabel(double)));
+
+                    QMutexLocker locker(&videoMutex);
+                    video = stabilizer;
+                }
+
+                // Follow the rate of the source instead of a fixed interval
+                int interval = captureThread->frameScheduler().interval();
+                if(refreshTimer->interval() != interval)
+                {
+                    refreshTimer->setInterval(interval);
                 }
 
-                cv::Mat frame;
+                FrameDescriptor descriptor;
+                bool presented = false;
 
-                if(captureVideo.read(frame))
+                if(workerPool != NULL)
+                {
+                    // Processed on the shared workers as frames arrive, see processCapturedFrame()
+                    presented = takeProcessedFrame(descriptor);
+                }
+                else if(captureThread->takeFrame(descriptor))
                 {
                     if(isRecord)
                     {
-                        if(!existFileMovie)
-                        {
-                            QString fileName = QDate::currentDate().toString("yyyyMMdd")+QTime::currentTime().toString("HHmmss");
-                            QString path = pathVideo+fileName+".avi";
-                            writerMovie.open(path.toLatin1().data(), CV_FOURCC('D','I','V','X'), 30, frame.size(), true);
-
-                            createFileSubTitles(pathVideo+fileName);
-
-                            existFileMovie = true;
-                        }                        
-
-                        writerMovie << frame;
+                        recordFrame(descriptor);
                     }
-
-
-
-                    if(videoTracking)
+                    else if(preEvent->isEnabled())
                     {
-                        if(selected)
-                        {
-                            this->frame = frame;
-
-                            try
-                            {
-                                areaInterest = frame(Rect(trackingPoint.x - sizeAreaInterest/2.0, trackingPoint.y - sizeAreaInterest/2.0, sizeAreaInterest, sizeAreaInterest));
-
-                                // Detect the keypoints
-                                featureDetectInterest->detect(areaInterest, keyPointsInterest); // NOTE: featureDetector is a pointer hence the '->'.
-                                //   printf("Termina featureDetectorObject %d\n" , time.mds);
-                                //Similarly, we create a smart pointer to the SIFT extractor.
-                                Ptr<DescriptorExtractor> featureExtractorObject = DescriptorExtractor::create(FeatureMethod);
-
-                                // Compute the 128 dimension SIFT descriptor at each keypoint.
-                                // Each row in "descriptors" correspond to the SIFT descriptor for each keypoint
-
-                                featureExtractorObject->compute(areaInterest, keyPointsInterest, descriptorsInterest);
-
-                                if(drawDescriptors)
-                                {
-                                    // If you would like to draw the detected keypoint just to check
-                                    Scalar keypointColorObject = Scalar(255, 0, 0);     // Blue keypoints.
-                                    drawKeypoints(areaInterest, keyPointsInterest, areaInterest, keypointColorObject, DrawMatchesFlags::DEFAULT);
-                                }
-
-                                selected = false;
-                                tracking = true;
-                            }
-                            catch(...)
-                            {
-                                qDebug()<<"Error...";
-                            }
-
-                        }
-
-                        processTracking();
+                        preEvent->push(unsharedFrame(descriptor));
                     }
 
-                    if(videoStabilizated)
-                    {
-                        cv::cvtColor(frame,frame, CV_BGR2GRAY);
-                        cv::Mat output = cv::Mat::zeros(frame.rows, frame.cols, CV_8UC1);
-                        video->stabilizeImage(frame,output);
-                        cv::cvtColor(output,output, CV_GRAY2RGB);
+                    processFrame(descriptor);
+                    presented = takeProcessedFrame(descriptor);
+                }
 
-                        glImage = QImage((const unsigned char*)(output.data), output.cols, output.rows, QImage::Format_RGB888);
-                    }
-                    else
-                    {
-                        cv::cvtColor(frame,frame, CV_BGR2RGB);
-                        glImage = QImage((const unsigned  char*)(frame.data), frame.cols, frame.rows, QImage::Format_RGB888);
-                    }
+                if(presented)
+                {
+                    glImage = QImage((const unsigned char*)(displayFrame.data), displayFrame.cols, displayFrame.rows, (int)displayFrame.step, QImage::Format_RGB888);
 
                     scalingFactor = this->width()/vwidth;
                     double scalingFactorH = this->height()/vheight;
                     if (scalingFactorH < scalingFactor)
                         scalingFactor = scalingFactorH;
 
+                    // Scaled while drawing instead of through a scaled copy of the image
+                    QSize imageSize = glImage.size();
+                    imageSize.scale(this->width(), this->height(), Qt::KeepAspectRatio);
+                    QRectF imageRect(refToScreenX(-vwidth/2.0), refToScreenY(-vheight/2.0), imageSize.width(), imageSize.height());
+
                     QPainter painter;
                     painter.begin(this);
                     painter.setRenderHint(QPainter::Antialiasing, true);
@@ -455,7 +651,7 @@ void OverlayData::paintTelemetry()
 //                        painter.translate((this->vwidth/2.0+xCenterOffset)*scalingFactor, (this->vheight/2.0+yCenterOffset)*scalingFactor);
 
                         painter.fillRect(refToScreenX((-vwidth/2.0)), refToScreenY(-vheight/2.0), this->width(), this->height(), Qt::black);
-                        painter.drawImage(refToScreenX((-vwidth/2.0)), refToScreenY(-vheight/2.0), glImage.scaled(this->width(), this->height(), Qt::KeepAspectRatio));
+                        painter.drawImage(imageRect, glImage);
                         //painter.fillRect(0, 0, this->width(), this->height(), Qt::black);
                         //painter.drawImage(0,0, glImage.scaled(this->width(), this->height(), Qt::KeepAspectRatio));
                         //painter.drawImage(0,0, glImage.scaled(this->width(), this->height(), Qt::KeepAspectRatioByExpanding));
@@ -491,6 +687,12 @@ void OverlayData::paintTelemetry()
 
                         paintText(state, infoColor, 3.0f, (-vwidth/2.0) + 150, -vheight/2.0 + 15, &painter);
 
+                        if(videoStabilizated)
+                        {
+                            QString stabilization("Estabilizacion: %1 ms");
+                            paintText(stabilization.arg(stabilizerTime, 4, 'f', 1, '0'), infoColor, 3.0f, (-vwidth/2.0) + 150, -vheight/2.0 + 10, &painter);
+                        }
+
                         QString speed4("Latitud: %1 N");
                         paintText(speed4.arg(lat, 4, 'f', 4, '0'), infoColor, 3.0f, (-vwidth/2.0) + 10, vheight/2 - 35, &painter);
 
@@ -529,10 +731,17 @@ void OverlayData::paintTelemetry()
                         //painter.fillRect(0, 0, this->width(), this->height(), Qt::black);
                         //painter.drawImage(0,0, glImage.scaled(this->width(), this->height(), Qt::KeepAspectRatio));
                         painter.fillRect(refToScreenX((-vwidth/2.0)), refToScreenY(-vheight/2.0), this->width(), this->height(), Qt::black);
-                        painter.drawImage(refToScreenX((-vwidth/2.0)), refToScreenY(-vheight/2.0), glImage.scaled(this->width(), this->height(), Qt::KeepAspectRatio));
+                        painter.drawImage(imageRect, glImage);
 
                         painter.end();
                     }
+
+                    descriptor.markStage(FrameDescriptor::Displayed, captureThread->currentTime());
+                    captureThread->frameScheduler().frameDisplayed(descriptor.stageTimes[FrameDescriptor::Displayed], descriptor.captureTime);
+
+                    // Only the identity is kept, the buffer goes back to the pool
+                    lastFrame = descriptor;
+                    lastFrame.image.release();
                 }
             }
         }
@@ -658,6 +867,95 @@ void OverlayData::enableStabilizationVideo(bool enabled)
     videoStabilizated = enabled;
 }
 
+void OverlayData::updateTimeLabel(double durationInMs)
+{
+    stabilizerTime = durationInMs;
+}
+
+void OverlayData::setStabilizerSearch(int strategy)
+{
+    if(strategy < 0 || strategy >= videoStabilizer::SearchStrategyCount)
+        return;
+
+    stabilizerSearch = strategy;
+    stabilizerSearchGroup->actions().at(strategy)->setChecked(true);
+
+    if(!video.isNull())
+    {
+        video->setSearchStrategy((videoStabilizer::SearchStrategy)strategy);
+    }
+}
+
+void OverlayData::selectStabilizerSearch(QAction* action)
+{
+    setStabilizerSearch(action->data().toInt());
+}
+
+void OverlayData::enableStabilizerEvaluation(bool enabled)
+{
+    stabilizerEvaluation = enabled;
+
+    if(video.isNull())
+        return;
+
+    video->setSearchEvaluation(enabled);
+
+    // The statistics keep adding up, the strategy in use keeps what it measured before
+    if(!enabled)
+    {
+        QList<QAction*> actions = stabilizerSearchGroup->actions();
+        QStringList results;
+
+        for(int i = 0; i < videoStabilizer::SearchStrategyCount; i++)
+        {
+            videoStabilizer::SearchStatistics statistics = video->searchStatistics((videoStabilizer::SearchStrategy)i);
+
+            results << tr("%1: %2 ms, %3 candidatos, %4 filas, error %5, costo %6")
+                       .arg(actions.at(i)->text())
+                       .arg(statistics.time, 0, 'f', 2)
+                       .arg(statistics.candidates, 0, 'f', 1)
+                       .arg(statistics.rows, 0, 'f', 0)
+                       .arg(statistics.error, 0, 'f', 2)
+                       .arg(statistics.costRatio, 0, 'f', 2);
+        }
+
+        emit emitTitle(results.join(" | "));
+    }
+}
+
+void OverlayData::setStabilizerGrid(int size)
+{
+    if(size < 0 || size > MAX_GRID_SIZE)
+        return;
+
+    stabilizerGrid = size;
+
+    foreach(QAction* action, stabilizerGridGroup->actions())
+    {
+        action->setChecked(action->data().toInt() == size);
+    }
+
+    if(!video.isNull())
+    {
+        video->setSubframeGrid(size, size);
+    }
+}
+
+void OverlayData::selectStabilizerGrid(QAction* action)
+{
+    setStabilizerGrid(action->data().toInt());
+}
+
+void OverlayData::enableStabilizerEarlyTermination(bool enabled)
+{
+    stabilizerEarlyTermination = enabled;
+
+    if(!video.isNull())
+    {
+        video->setEarlyTermination(enabled);
+    }
+}
+
 void OverlayData::enableTrackingPosition(bool enabled)
 {
     videoTracking = enabled;
@@ -668,6 +966,54 @@ void OverlayData::enableSendTrackingPosition(bool enabled)
     sendTrackingVideo = enabled;
 }
 
+void OverlayData::enableLowLatencyVideo(bool enabled)
+{
+    captureThread->setLowLatency(enabled);
+}
+
+void OverlayData::enablePreEventRecording(bool enabled)
+{
+    preEvent->setEnabled(enabled);
+}
+
+void OverlayData::setPreEventLimits(int duration, qint64 memory)
+{
+    preEvent->setDuration(duration);
+    preEvent->setMemoryLimit(memory);
+}
+
+void OverlayData::setPreEventCost(int quality, double fps)
+{
+    preEvent->setQuality(quality);
+    preEvent->setMaximumFps(fps);
+}
+
+qint64 OverlayData::getPreEventMemory() const
+{
+    return preEvent->memoryUsage();
+}
+
+qint64 OverlayData::getPreEventDuration() const
+{
+    return preEvent->bufferedDuration();
+}
+
+double OverlayData::getPreEventEncodeTime() const
+{
+    return preEvent->averageEncodeTime();
+}
+
+void OverlayData::enablePassThroughRecording(bool enabled)
+{
+    passThroughRecording = enabled;
+}
+
+void OverlayData::setLatencyTarget(int target)
+{
+    latencyTarget = target;
+    captureThread->frameScheduler().setLatencyTarget(latencyTarget);
+}
+
 void OverlayData::openFile()
 {
     QString filename = QFileDialog::getOpenFileName(this, "Abrir Video", this->pathVideo, "Archivos (*.mp4 | *.mpg | *.avi | *.mov)");
@@ -696,50 +1042,301 @@ void OverlayData::record(bool value)
     if(!isRecord)
     {
         existFileMovie = false;
+        recorder->close();
+        remuxer->close();
+    }
+
+    emit emitRecord(isRecord);
+}
+
+void OverlayData::processFrame(FrameDescriptor& descriptor)
+{
+    cv::Mat frame = descriptor.image;
+
+    {
+        // The selection of the mouse arrives on the interface thread
+        QMutexLocker locker(&trackingMutex);
+
+        if(videoTracking)
+        {
+            if(selected)
+            {
+                this->frame = frame;
 
-        if(fileSubtitles != NULL && fileSubtitles->isOpen())
+                try
+                {
+                    areaInterest = frame(Rect(trackingPoint.x - sizeAreaInterest/2.0, trackingPoint.y - sizeAreaInterest/2.0, sizeAreaInterest, sizeAreaInterest));
+
+                    // Detect the keypoints
+                    featureDetectInterest->detect(areaInterest, keyPointsInterest); // NOTE: featureDetector is a pointer hence the '->'.
+                    //   printf("Termina featureDetectorObject %d\n" , time.mds);
+                    //Similarly, we create a smart pointer to the SIFT extractor.
+                    Ptr<DescriptorExtractor> featureExtractorObject = DescriptorExtractor::create(FeatureMethod);
+
+                    // Compute the 128 dimension SIFT descriptor at each keypoint.
+                    // Each row in "descriptors" correspond to the SIFT descriptor for each keypoint
+
+                    featureExtractorObject->compute(areaInterest, keyPointsInterest, descriptorsInterest);
+
+                    if(drawDescriptors)
+                    {
+                        // If you would like to draw the detected keypoint just to check
+                        Scalar keypointColorObject = Scalar(255, 0, 0);     // Blue keypoints.
+                        drawKeypoints(areaInterest, keyPointsInterest, areaInterest, keypointColorObject, DrawMatchesFlags::DEFAULT);
+                    }
+
+                    selected = false;
+                    tracking = true;
+                }
+                catch(...)
+                {
+                    qDebug()<<"Error...";
+                }
+
+            }
+
+            processTracking();
+            descriptor.markStage(FrameDescriptor::Tracked, captureThread->currentTime());
+        }
+    }
+
+    // Kept alive by this frame if the interface replaces it meanwhile
+    QSharedPointer<videoStabilizer> stabilizer;
+
+    {
+        QMutexLocker locker(&videoMutex);
+        stabilizer = video;
+    }
+
+    // Only one frame is processed at a time, so the conversion buffers are only allocated when the size changes
+    if(videoStabilizated && !stabilizer.isNull())
+    {
+        cv::cvtColor(frame, grayFrame, CV_BGR2GRAY);
+
+        cv::Point offset;
+        Mat view = stabilizer->stabilizeView(grayFrame, offset);
+        descriptor.markStage(FrameDescriptor::Stabilized, captureThread->currentTime());
+
+        // The view is converted straight to its place, only the border left by the shift is cleared
+        processedFrame.create(grayFrame.rows, grayFrame.cols, CV_8UC3);
+        cv::Rect region(offset, view.size());
+        videoStabilizer::clearOutside(processedFrame, region);
+
+        Mat target = processedFrame(region);
+        cv::cvtColor(view, target, CV_GRAY2RGB);
+    }
+    else
+    {
+        cv::cvtColor(frame, processedFrame, CV_BGR2RGB);
+    }
+
+    // Only the identity of the frame is kept, the buffer goes back to the pool
+    QMutexLocker locker(&resultMutex);
+    cv::swap(processedFrame, readyFrame);
+    readyDescriptor = descriptor;
+    readyDescriptor.image.release();
+    processedReady = true;
+}
+
+bool OverlayData::takeProcessedFrame(FrameDescriptor& descriptor)
+{
+    QMutexLocker locker(&resultMutex);
+
+    if(!processedReady)
+    {
+        return false;
+    }
+
+    // The painted buffer is never touched by the processing
+    cv::swap(readyFrame, displayFrame);
+    descriptor = readyDescriptor;
+    processedReady = false;
+
+    return true;
+}
+
+void OverlayData::processCapturedFrame()
+{
+    if(workerPool == NULL)
+    {
+        return;
+    }
+
+    FrameDescriptor descriptor;
+
+    if(!captureThread->takeFrame(descriptor))
+    {
+        return;
+    }
+
+    // Every frame taken is recorded, even when its processing is skipped
+    if(isRecord)
+    {
+        recordFrame(descriptor);
+    }
+    else if(preEvent->isEnabled())
+    {
+        preEvent->push(unsharedFrame(descriptor));
+    }
+
+    workerPool->submit(streamId, new FrameProcessingJob(this, descriptor));
+}
+
+void OverlayData::setWorkerPool(StreamWorkerPool* pool, int budget)
+{
+    if(workerPool != NULL)
+    {
+        workerPool->removeStream(streamId);
+    }
+
+    workerPool = pool;
+    streamId = -1;
+
+    // A shared worker searches every subframe itself, within the budget of this video
+    if(!video.isNull())
+    {
+        video->setSubframeWorkers(workerPool == NULL);
+    }
+
+    if(workerPool != NULL)
+    {
+        streamId = workerPool->addStream(budget);
+    }
+}
+
+StreamWorkerPool* OverlayData::getWorkerPool() const
+{
+    return workerPool;
+}
+
+int OverlayData::getStreamId() const
+{
+    return streamId;
+}
+
+quint64 OverlayData::getSkippedProcessing() const
+{
+    return workerPool != NULL ? workerPool->skippedJobs(streamId) : 0;
+}
+
+FrameDescriptor OverlayData::unsharedFrame(const FrameDescriptor& frame) const
+{
+    FrameDescriptor unshared = frame;
+
+    // Tracking draws on the frame while another thread may still be compressing it
+    if(videoTracking)
+    {
+        unshared.image = frame.image.clone();
+    }
+
+    return unshared;
+}
+
+void OverlayData::recordFrame(FrameDescriptor& frame)
+{
+    if(!existFileMovie)
+    {
+        QString fileName = QDate::currentDate().toString("yyyyMMdd")+QTime::currentTime().toString("HHmmss");
+        remuxing = passThroughRecording && StreamRemuxer::isAvailable();
+
+        if(remuxing)
+        {
+            // Copies the compressed packets of the source, the decoded frames are not needed
+            remuxer->open(urlVideo, pathVideo+fileName, frame.streamPosition, captureThread->currentTime());
+
+            // The packets before the recording are not kept, nor are these frames left for the next one
+            preEvent->takeFrames();
+        }
+        else
         {
-            isSubTitles = false;
-            countSubTitle =0;
-            startTime=-1;
-            fileSubtitles->close();
-            fileSubtitles->flush();
-            qDebug()<<"closing file subtittles";
+            // The container has a fixed rate, so it takes the one measured from the source
+            double recordFps = captureThread->frameScheduler().sourceFps();
+
+            if(recordFps < 1.0)
+            {
+                recordFps = captureThread->sourceFps() > 0.0 ? captureThread->sourceFps() : defaultRecordFps;
+            }
+
+            // The previous recording may still be encoding its queue, the display does not wait for it
+            if(recorder->isRunning())
+            {
+                finishRecorder();
+            }
+
+            // Starts with the seconds kept from before the recording
+            recorder->open(pathVideo+fileName, recordFps, frame.image.size(), preEvent->takeFrames());
         }
+
+        existFileMovie = true;
     }
 
-    emit emitRecord(isRecord);
+    // Logged next to the segment the frame goes to, by the thread that writes that segment
+    TelemetryRecord record;
+    record.sequence = frame.sequence;
+    record.captureTime = frame.captureTime;
+    record.groundTime = getGroundTimeNow();
+    record.latitude = lat;
+    record.longitude = lon;
+    record.altitude = alt;
+    record.battery = battery;
+    record.airSpeed = airSpeed;
+
+    if(remuxing)
+    {
+        // Pass-through keeps every frame of the source, so every frame has its record
+        remuxer->appendTelemetry(record);
+        return;
+    }
+
+    if(!recorder->write(unsharedFrame(frame), record))
+        return;
+
+    frame.markStage(FrameDescriptor::Recorded, captureThread->currentTime());
 }
 
 void OverlayData::setURL(QString url)
 {
     videoStabilizated = false;
-    captureVideo.release();
 
-    if(!captureVideo.open(url.toLatin1().data()))
+    // The new video may have another size
+    if(!video.isNull())
     {
-        emit emitTitle("Error al abrir video...");
-        return;
+        QMutexLocker locker(&videoMutex);
+        video.clear();
     }
 
     this->urlVideo = url;
     emit emitTitle(urlVideo);
+
+    // Recordings have an index next to them, it is optional for seeking
+    seekIndex.clear();
+
+    if(!url.contains("://"))
+    {
+        QFileInfo info(url);
+        seekIndex.load(info.path() + "/" + info.completeBaseName() + SeekIndex::fileExtension());
+    }
+
+    if(refreshTimer->isActive())
+    {
+        closeCapture();
+        captureThread->open(urlVideo);
+    }
 }
 
 void OverlayData::playMovie()
 {
     if(!refreshTimer->isActive())
     {
-        if(!captureVideo.isOpened())
+        if(urlVideo.isEmpty())
         {
-            if(!captureVideo.open(urlVideo.toLatin1().data()))
-            {
-                emit emitTitle("Error al abrir video...");
-                return;
-            }
+            emit emitTitle("Error al abrir video...");
+            return;
         }
 
-        refreshTimer->start(updateInterval);
+        // Opens in the background, the progress is shown through emitTitle
+        captureThread->open(urlVideo);
+        refreshTimer->start(captureThread->frameScheduler().interval());
 
         if(savedAutomatic)
         {
@@ -760,8 +1357,115 @@ void OverlayData::stopMovie()
         refreshTimer->stop();      
 
         videoStabilizated = false;
-        captureVideo.release();
+        closeCapture();
+    }
+}
+
+void OverlayData::seekVideo(qint64 milliseconds)
+{
+    if(!seekIndex.isEmpty())
+    {
+        seekFrame(seekIndex.frameAtTime(milliseconds));
+        return;
+    }
+
+    // Without index the rate reported by the source is the best guess
+    double fps = captureThread->sourceFps();
+    seekFrame(fps > 0.0 ? qRound64(milliseconds*fps/1000.0) : 0);
+}
+
+void OverlayData::seekTelemetry(quint64 sequence)
+{
+    if(seekIndex.isEmpty())
+    {
+        emit emitTitle(tr("El video no tiene indice de grabacion"));
+        return;
+    }
+
+    seekFrame(seekIndex.frameOfSequence(sequence));
+}
+
+void OverlayData::seekFrame(qint64 frame)
+{
+    if(!refreshTimer->isActive())
+        return;
+
+    // A file that ended is opened again to go back
+    if(captureThread->isFinished())
+    {
+        captureThread->open(urlVideo);
     }
+
+    captureThread->seek(frame);
+}
+
+qint64 OverlayData::getVideoDuration() const
+{
+    return seekIndex.isEmpty() ? -1 : seekIndex.duration();
+}
+
+void OverlayData::closeCapture()
+{
+    // A running job still uses the capture clock
+    if(workerPool != NULL)
+    {
+        workerPool->waitForStream(streamId);
+    }
+
+    if(captureThread->stop(stopTimeout))
+    {
+        return;
+    }
+
+    // A read blocked on the network can not be interrupted, that thread is left to end by itself
+    VideoCaptureThread* blockedThread = captureThread;
+    disconnect(blockedThread, 0, this, 0);
+    blockedThread->setParent(NULL);
+    connect(blockedThread, SIGNAL(finished()), blockedThread, SLOT(deleteLater()));
+
+    if(blockedThread->isFinished())
+    {
+        blockedThread->deleteLater();
+    }
+
+    captureThread = createCaptureThread();
+    captureThread->setLowLatency(blockedThread->isLowLatency());
+}
+
+void OverlayData::finishRecorder()
+{
+    VideoRecorder* finishingRecorder = recorder;
+    finishingRecorder->setParent(NULL);
+    connect(finishingRecorder, SIGNAL(finished()), finishingRecorder, SLOT(deleteLater()));
+
+    if(finishingRecorder->isFinished())
+    {
+        finishingRecorder->deleteLater();
+    }
+
+    recorder = createRecorder();
+}
+
+VideoRecorder* OverlayData::createRecorder()
+{
+    VideoRecorder* newRecorder = new VideoRecorder(recordQueueSize, this);
+    newRecorder->setBackpressure(recordBackpressure);
+    newRecorder->recordingSegments().setLimits(recordSegmentDuration, recordSegmentSize);
+    newRecorder->recordingSegments().setRetention(recordRetention);
+    connect(newRecorder, SIGNAL(error(QString)), this, SIGNAL(emitTitle(QString)));
+
+    return newRecorder;
+}
+
+VideoCaptureThread* OverlayData::createCaptureThread()
+{
+    // The recorder queue holds frames of the pool, its buffers are counted too
+    VideoCaptureThread* thread = new VideoCaptureThread(recordQueueSize + heldFrames, this);
+    thread->frameScheduler().setLatencyTarget(latencyTarget);
+    connect(thread, SIGNAL(stateChanged(QString)), this, SIGNAL(emitTitle(QString)));
+    connect(thread, SIGNAL(frameCaptured()), this, SLOT(processCapturedFrame()));
+
+    return thread;
 }
 
 void OverlayData::mousePressEvent(QMouseEvent *event)
@@ -789,8 +1493,11 @@ void OverlayData::mousePressEvent(QMouseEvent *event)
         //        qDebug()<<"Pointy: "<<yMouse*x;
 
         emit emitPositionTracking(xMouse*y, yMouse*x);
+
+        trackingMutex.lock();
         trackingPoint = cvPoint(xMouse*y, yMouse*x);
         selected = true;
+        trackingMutex.unlock();
 
         if(!glImage.isNull())
         {
@@ -845,64 +1552,46 @@ quint64 OverlayData::getGroundTimeNow()
     return static_cast<quint64>(milliseconds + time.time().msec());
 }
 
-void OverlayData::createFileSubTitles(QString file)
+void OverlayData::exportSubTitles()
 {
-    QString fileName(file);
+    QString filename = QFileDialog::getOpenFileName(this, tr("Exportar subtitulos"), this->pathVideo, tr("Telemetria (*%1)").arg(TelemetryLog::fileExtension()));
 
-    if (fileName.isEmpty())
+    if(filename.isEmpty())
         return;
 
-    QString tempFile(QFileInfo(fileName).baseName());
-    QString tempPath(QFileInfo(fileName).dir().path()+"/");
-
-    if(fileSubtitles== NULL)
-    {
-        fileSubtitles = new QFile();
-    }
+    QString srtFile = filename.left(filename.length() - TelemetryLog::fileExtension().length()) + ".srt";
 
-    if(fileSubtitles->fileName() != tempPath + "/" + tempFile + ".srt")
+    if(!TelemetryLog::exportSubTitles(filename, srtFile))
     {
-        if(!QFileInfo(tempPath+"/"+tempFile+".srt").exists())
-        {
-            fileSubtitles->setFileName(file+".srt");
-            fileSubtitles->open(QIODevice::WriteOnly | QIODevice::Append);
-        }
+        qDebug()<<"Error exporting subtitles"<<filename;
+        emit emitTitle(tr("Error al exportar subtitulos %1").arg(srtFile));
+        return;
     }
 
-    this->isSubTitles = true;
+    emit emitTitle(tr("Subtitulos exportados %1").arg(srtFile));
 }
 
-void OverlayData::refreshTimeOut()
+void OverlayData::setRecordSegments(int duration, qint64 size)
 {
-    if(isSubTitles)
-    {
-        if(fileSubtitles->exists())
-        {
-            QTextStream streamData(fileSubtitles);
-
-            if(startTime== (quint64)-1)
-            {
-                startTime = getGroundTimeNow();
-            }
-
-            quint64 filterTime = (getGroundTimeNow()-startTime)/1000;
-            int sec = static_cast<int>(filterTime - static_cast<int>(filterTime / 60) * 60);
-            int min = static_cast<int>(filterTime / 60)-((static_cast<int>(filterTime / 60)/60)*60);
-            int hours = static_cast<int>((filterTime / 60)/60);
-            QString timeText1;
-            timeText1 = timeText1.sprintf("%02d:%02d:%02d", hours, min, sec);
-
-            streamData
-                    << countSubTitle << "\r\n"
-                    << timeText1 << " <i> Lat: "<<this->lat<<" - Lon: "<<this->lon<<" - Alt: "<<this->alt<<"</i> \r\n"
-                    << "\r\n\n";
+    recordSegmentDuration = duration;
+    recordSegmentSize = size;
+    recorder->recordingSegments().setLimits(duration, size);
+    remuxer->recordingSegments().setLimits(duration, size);
+}
 
-            countSubTitle++;
-        }
-    }
+void OverlayData::setRecordRetention(qint64 size)
+{
+    recordRetention = size;
+    recorder->recordingSegments().setRetention(size);
+    remuxer->recordingSegments().setRetention(size);
+}
 
+void OverlayData::refreshTimeOut()
+{
     if(sendTrackingVideo)
     {
+        QMutexLocker locker(&trackingMutex);
+
         if(moveTracking == secondTracking)
         {
             if(abs(videoCenter.x - trackingPoint.x) > distanceCenter || abs(videoCenter.y - trackingPoint.y) > distanceCenter)
@@ -1189,6 +1878,16 @@ void OverlayData::processTracking()
     }
 }
 
+void OverlayData::setStabilizerParameters(const videoStabilizer::Parameters& parameters)
+{
+    stabilizerParameters = parameters;
+
+    if(!video.isNull())
+    {
+        video->setParameters(parameters);
+    }
+}
+
 void OverlayData::setSavedAutomatic(bool automatic)
 {
     savedAutomatic = automatic;
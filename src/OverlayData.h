@@ -34,8 +34,11 @@ This file is part of the QGROUNDCONTROL project
 #include <QShowEvent>
 #include <QContextMenuEvent>
 #include <QMenu>
+#include <QActionGroup>
 #include <QDesktopServices>
 #include <QFileDialog>
+#include <QMutex>
+#include <QSharedPointer>
 
 #include <QDebug>
 #include <cmath>
@@ -45,6 +48,14 @@ This file is part of the QGROUNDCONTROL project
 #include "opencv2/core/core.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include "videoStabilizer.h"
+#include "VideoCaptureThread.h"
+#include "FrameDescriptor.h"
+#include "StreamWorkerPool.h"
+#include "VideoRecorder.h"
+#include "StreamRemuxer.h"
+#include "PreEventBuffer.h"
+#include "TelemetryLog.h"
+#include "SeekIndex.h"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/features2d/features2d.hpp"
 #include "opencv2/calib3d/calib3d.hpp"
@@ -74,12 +85,109 @@ public:
 
     //void resizeGL(int w, int h);
 
-    /** @brief OpenCV class for holds URL video */
-    cv::VideoCapture captureVideo;
-    /** @brief OpenCV class for writer video */
-    cv::VideoWriter writerMovie;
-    /** This is the video stabilizer algorithm class*/
-    videoStabilizer* video;
+    /** @brief Return the number of decoded frames waiting to be displayed */
+    int getFrameQueueDepth() const;
+    /** @brief Return the number of frames decoded since the video was opened */
+    quint64 getCapturedFrames() const;
+    /** @brief Return the number of decoded frames taken for display */
+    quint64 getDisplayedFrames() const;
+    /** @brief Return the number of decoded frames dropped because display fell behind */
+    quint64 getDroppedFrames() const;
+    /** @brief Return the frame rate estimated from the timestamps of the source */
+    double getSourceFps() const;
+    /** @brief Return the frame rate achieved by the display */
+    double getDisplayFps() const;
+    /** @brief Return the jitter in milliseconds of the intervals between frames shown */
+    double getDisplayJitter() const;
+    /** @brief Return the average capture to display latency in milliseconds */
+    double getAverageLatency() const;
+    /** @brief Return the largest capture to display latency in milliseconds */
+    qint64 getMaximumLatency() const;
+    /** @brief Return the number of frames shown later than the latency target */
+    quint64 getFramesOverLatencyTarget() const;
+    /** @brief Return the number of frames buffered by the RTSP client that were skipped */
+    quint64 getSkippedFrames() const;
+    /**
+     * @brief Return the time from the capture of the last frame shown until a stage finished with it.
+     *
+     * @param stage Stage of the pipeline
+     * @return Latency in milliseconds, -1 if the last frame did not go through the stage
+     **/
+    qint64 getStageLatency(FrameDescriptor::Stage stage) const;
+    /** @brief Return the sequence number of the last frame shown */
+    quint64 getLastFrameSequence() const;
+    /** @brief Return the number of frames encoded in the current recording */
+    quint64 getRecordedFrames() const;
+    /** @brief Return the number of frames the recorder dropped because the encoder fell behind */
+    quint64 getRecordDroppedFrames() const;
+    /** @brief Return the number of frames not recorded because they came faster than the rate of the video */
+    quint64 getRecordSkippedFrames() const;
+    /** @brief Return the number of frames waiting to be encoded */
+    int getRecordQueueDepth() const;
+    /** @brief Sets what the recorder does when the encoder falls behind */
+    void setRecordBackpressure(VideoRecorder::Backpressure policy);
+    /** @brief Return the number of bytes written by the pass-through recording */
+    quint64 getPassThroughBytes() const;
+    /**
+     * @brief Sets how much video is kept from before a recording starts.
+     *
+     * @param duration  Seconds kept
+     * @param memory    Largest memory in bytes used by the kept frames
+     **/
+    void setPreEventLimits(int duration, qint64 memory);
+    /**
+     * @brief Sets the cost of keeping the video from before a recording starts.
+     *
+     * @param quality   JPEG quality of the kept frames, from 0 to 100
+     * @param fps       Largest rate of kept frames, 0 keeps every frame
+     **/
+    void setPreEventCost(int quality, double fps);
+    /** @brief Return the memory in bytes used by the video kept from before a recording */
+    qint64 getPreEventMemory() const;
+    /** @brief Return the milliseconds of video kept from before a recording */
+    qint64 getPreEventDuration() const;
+    /** @brief Return the average milliseconds to compress a kept frame */
+    double getPreEventEncodeTime() const;
+    /**
+     * @brief Processes the frames on worker threads shared with other overlays instead of
+     * on the interface thread. The timer of the widget then only paints finished frames.
+     *
+     * @param pool      The shared workers, NULL to process on the interface thread
+     * @param budget    Milliseconds of worker time per second for this video, 0 for an even share
+     **/
+    void setWorkerPool(StreamWorkerPool* pool, int budget = 0);
+    /** @brief Return the shared workers, NULL if frames are processed on the interface thread */
+    StreamWorkerPool* getWorkerPool() const;
+    /** @brief Return the identifier of this video in the shared workers */
+    int getStreamId() const;
+    /** @brief Return the number of frames not processed because the previous one was still running or the budget of this video was spent */
+    quint64 getSkippedProcessing() const;
+    /** @brief Return the duration in milliseconds of a recorded video, -1 if it has no index */
+    qint64 getVideoDuration() const;
+    /**
+     * @brief Tracks, stabilizes and converts a frame for display. Runs on a worker thread when
+     * a pool is set, one frame at a time.
+     *
+     * @param descriptor The frame, stamped with the stages it goes through
+     **/
+    void processFrame(FrameDescriptor& descriptor);
+
+    /** @brief Thread that decodes the URL video */
+    VideoCaptureThread* captureThread;
+    /** @brief Thread that encodes the recorded video */
+    VideoRecorder* recorder;
+    /** @brief Settings of the recorder, given again to the one replacing it */
+    int recordSegmentDuration;
+    qint64 recordSegmentSize;
+    qint64 recordRetention;
+    VideoRecorder::Backpressure recordBackpressure;
+    /** @brief Thread that records the compressed stream without encoding it again */
+    StreamRemuxer* remuxer;
+    /** @brief Last seconds of video, written first when a recording starts */
+    PreEventBuffer* preEvent;
+    /** This is the video stabilizer algorithm class, a job stabilizing a frame holds it until it ends
+        even if it is replaced meanwhile. Only replaced on the interface thread, under videoMutex */
+    QSharedPointer<videoStabilizer> video;
     /** @brief Used to holds if record video */
     bool isRecord;
     bool existFileMovie;    
@@ -97,6 +205,36 @@ public slots:
       * @param enabled Enable stabilization video
     */
     void enableStabilizationVideo(bool enabled);
+    /** @brief Keep the average time of the stabilizer, shown with the telemetry
+      *
+      * @param durationInMs Average milliseconds to stabilize a frame
+    */
+    void updateTimeLabel(double durationInMs);
+    /** @brief Set the block search used by the stabilizer
+      *
+      * @param strategy One of videoStabilizer::SearchStrategy
+    */
+    void setStabilizerSearch(int strategy);
+    /** @brief Run every block search on each frame and compare them with the full search, the
+      * statistics are shown in the title when it is disabled
+      *
+      * @param enabled Enable evaluation
+    */
+    void enableStabilizerEvaluation(bool enabled);
+    /** @brief Stop the stabilizer matches that can not beat the best one, disabled to measure the gain
+      *
+      * @param enabled Enable early termination
+    */
+    void enableStabilizerEarlyTermination(bool enabled);
+    /** @brief Set the stabilizer search of an action of the context menu */
+    void selectStabilizerSearch(QAction* action);
+    /** @brief Set the grid of subframes searched by the stabilizer
+      *
+      * @param size Columns and rows of the grid, 0 chooses them from the video height
+    */
+    void setStabilizerGrid(int size);
+    /** @brief Set the stabilizer grid of an action of the context menu */
+    void selectStabilizerGrid(QAction* action);
     /** @brief Enable the tracking of position
       *
       * @param enabled Enable tracking
@@ -107,6 +245,44 @@ public slots:
       * @param enabled Enable send tracking
     */
     void enableSendTrackingPosition(bool enabled);
+    /** @brief Enable the low latency mode of RTSP streams, only the newest frame is shown
+      *
+      * @param enabled Enable low latency
+    */
+    void enableLowLatencyVideo(bool enabled);
+    /** @brief Set the capture to display latency the frames should stay under
+      *
+      * @param target Latency target in milliseconds
+    */
+    void setLatencyTarget(int target);
+    /** @brief Hands the newest decoded frame to the shared workers, when a pool is set */
+    void processCapturedFrame();
+    /**
+      * @brief Records the compressed stream as it arrives instead of encoding the decoded
+      * frames, from the next recording. Needs the application built with FFmpeg.
+      *
+      * @param enabled Enable pass-through recording
+    */
+    void enablePassThroughRecording(bool enabled);
+    /**
+      * @brief Keeps the last seconds of video, so a recording starts with what happened
+      * before it was started. Not available for pass-through recordings.
+      *
+      * @param enabled Enable the pre-event recording
+    */
+    void enablePreEventRecording(bool enabled);
+    /**
+      * @brief Moves the playback of a file to a time, at once for recordings with an index.
+      *
+      * @param milliseconds Time from the start of the video
+    */
+    void seekVideo(qint64 milliseconds);
+    /**
+      * @brief Moves the playback of a recording to the frame of a telemetry record.
+      *
+      * @param sequence Sequence number of the record, see TelemetryRecord
+    */
+    void seekTelemetry(quint64 sequence);
     /**
       * @brief Receive UAS currently selected
       *
@@ -168,6 +344,12 @@ public slots:
     void changePATH(const QString& path);
 
     void setSavedAutomatic(bool automatic);
+    /**
+     * @brief Tunes the stabilizer for the camera, kept for the next videos.
+     *
+     * @param parameters Search, window and compensation limits
+     **/
+    void setStabilizerParameters(const videoStabilizer::Parameters& parameters);
 
 public slots:
     /** @brief This functions works in the OpenGL view, which is already translated by the x and y center offsets. */
@@ -251,12 +433,21 @@ public slots:
      * @return Time in milliseconds
      **/
     quint64 getGroundTimeNow();
+    /** @brief This method asks for a telemetry log and writes the subtitles of its video. */
+    void exportSubTitles();
     /**
-     * @brief This method receive the directory for creates the subtitle file to store GPS positions.
+     * @brief This method sets when the recording is split in a new file.
      *
-     * @param file Subtitle file for store GPS positions
+     * @param duration  Longest file in seconds, 0 for no limit
+     * @param size      Largest file in bytes, 0 for no limit
      */
-    void createFileSubTitles(QString file);
+    void setRecordSegments(int duration, qint64 size);
+    /**
+     * @brief This method sets the disk used by the recordings before the oldest are deleted.
+     *
+     * @param size Bytes kept in the video directory, 0 keeps every recording
+     */
+    void setRecordRetention(qint64 size);
     /** @brief This method refresh values timeout 1 second. */
     void refreshTimeOut();
 
@@ -297,13 +488,52 @@ protected:
      * @param e The event paint received
      */
     void paintEvent(QPaintEvent *e);
+    /** @brief Stop the capture, replacing the capture thread if it is blocked on the network */
+    void closeCapture();
+    /** @brief Create a capture thread connected to this widget */
+    VideoCaptureThread* createCaptureThread();
+    /** @brief Leave the recorder to finish encoding its queue by itself and replace it */
+    void finishRecorder();
+    /** @brief Create a recorder connected to this widget, with the recording settings */
+    VideoRecorder* createRecorder();
+    /**
+     * @brief Writes a frame to the recording, opening it on the first frame. Frames dropped
+     * since the last one are filled by repeating it, so the video keeps the capture timing.
+     *
+     * @param frame The frame to record, stamped with the recording stage
+     **/
+    void recordFrame(FrameDescriptor& frame);
+    /**
+     * @brief Moves the playback of a file to a frame, opening the file again if it ended.
+     *
+     * @param frame Number of the frame, from 0
+     **/
+    void seekFrame(qint64 frame);
+    /** @brief Return a frame whose pixels are not modified by the processing afterwards */
+    FrameDescriptor unsharedFrame(const FrameDescriptor& frame) const;
+    /**
+     * @brief Takes the last processed frame into the display buffer.
+     *
+     * @param descriptor Receives the identity of the frame
+     * @return True if a frame was processed since the last call
+     **/
+    bool takeProcessedFrame(FrameDescriptor& descriptor);
     /** @brief Initializate variables for tracking position */
     void initializeTracking();
     /** @brief Process video for tracking position */
     void processTracking();
 
 private:
-    static const int updateInterval = 40;
+    /** Time in milliseconds to wait for the capture thread to stop */
+    static const int stopTimeout = 500;
+    /** Recording rate used while the rate of the source is unknown */
+    static const int defaultRecordFps = 30;
+    /** Frames waiting to be encoded before the recorder applies its backpressure */
+    static const int recordQueueSize = 32;
+    /** Frames kept besides the recorder queue: tracked, processed and waiting to be compressed before an event */
+    static const int heldFrames = 3;
+    /** Seconds of each file of a recording */
+    static const int defaultSegmentDuration = 600;
 
     QImage glImage;
 
@@ -326,6 +556,22 @@ private:
     QColor defaultColor;
     QColor infoColor;
     QTimer* refreshTimer;
+    int latencyTarget;
+    /** Average milliseconds to stabilize a frame */
+    double stabilizerTime;
+    FrameDescriptor lastFrame;
+    StreamWorkerPool* workerPool;
+    int streamId;
+    /** Guards the tracking state shared with the processing */
+    QMutex trackingMutex;
+    /** Guards the hand over of processed frames to the display */
+    QMutex resultMutex;
+    /** Guards the stabilizer taken by the processing */
+    QMutex videoMutex;
+    FrameDescriptor readyDescriptor;
+    bool processedReady;
+    /** Index of the recording being played, empty for other videos */
+    SeekIndex seekIndex;
     //QFont font;
 
     bool telemetryData;
@@ -339,11 +585,25 @@ private:
     QAction* enableStabilization;
     QAction* enableTracking,
         *enableSendTracking;
-    bool isSubTitles, savedAutomatic;
-    QFile *fileSubtitles;
-    quint64 startTime;
-    int countSubTitle;
-    QTextStream streamData;
+    QAction* enableLowLatency;
+    QAction* enablePassThrough;
+    QAction* enablePreEvent;
+    bool passThroughRecording;
+    /** True if the current recording is pass-through */
+    bool remuxing;
+    QAction* exportSubTitlesAction;
+    /** One checkable action per stabilizer search, in the order of videoStabilizer::SearchStrategy */
+    QActionGroup* stabilizerSearchGroup;
+    QAction* enableSearchEvaluation;
+    QAction* enableEarlyTermination;
+    /** One checkable action per stabilizer grid, the size is the data of each action */
+    QActionGroup* stabilizerGridGroup;
+    int stabilizerGrid;
+    videoStabilizer::Parameters stabilizerParameters;
+    int stabilizerSearch;
+    bool stabilizerEvaluation;
+    bool stabilizerEarlyTermination;
+    bool savedAutomatic;
     QString urlVideo;
 
     //::Tracking
@@ -356,6 +616,10 @@ private:
 
     Mat frame,
         //outputFrame,
+        grayFrame,
+        displayFrame,
+        processedFrame,
+        readyFrame,
         areaInterest,
         areaSearch,
         descriptorsSearch,
@@ -0,0 +1,230 @@
+#include "PreEventBuffer.h"
+
+#include <QElapsedTimer>
+#include <QDebug>
+
+#include "opencv2/highgui/highgui.hpp"
+
+const double PreEventBuffer::smoothing = 1.0/16.0;
+
+PreEventBuffer::PreEventBuffer(QObject* parent)
+    : QThread(parent)
+{
+    hasPending = false;
+    enabled = false;
+    abort = false;
+    duration = 10;
+    memoryLimit = 64*1024*1024;
+    quality = 80;
+    maximumFps = 15.0;
+    memory = 0;
+    lastPushTime = -1;
+    encodeTime = 0.0;
+    skipped = 0;
+}
+
+PreEventBuffer::~PreEventBuffer()
+{
+    setEnabled(false);
+}
+
+void PreEventBuffer::setEnabled(bool enabled)
+{
+    {
+        QMutexLocker locker(&mutex);
+
+        if(this->enabled == enabled)
+            return;
+
+        this->enabled = enabled;
+        abort = !enabled;
+        pendingCondition.wakeAll();
+    }
+
+    if(enabled)
+    {
+        // Compressing must not take the time of the display
+        start(QThread::LowPriority);
+        return;
+    }
+
+    wait();
+
+    QMutexLocker locker(&mutex);
+    frames.clear();
+    pending = FrameDescriptor();
+    hasPending = false;
+    memory = 0;
+    lastPushTime = -1;
+}
+
+bool PreEventBuffer::isEnabled() const
+{
+    QMutexLocker locker(&mutex);
+    return enabled;
+}
+
+void PreEventBuffer::setDuration(int seconds)
+{
+    QMutexLocker locker(&mutex);
+    duration = qMax(seconds, 1);
+    trim();
+}
+
+void PreEventBuffer::setMemoryLimit(qint64 bytes)
+{
+    QMutexLocker locker(&mutex);
+    memoryLimit = qMax(bytes, (qint64)0);
+    trim();
+}
+
+void PreEventBuffer::setQuality(int quality)
+{
+    QMutexLocker locker(&mutex);
+    this->quality = qBound(0, quality, 100);
+}
+
+void PreEventBuffer::setMaximumFps(double fps)
+{
+    QMutexLocker locker(&mutex);
+    maximumFps = qMax(fps, 0.0);
+}
+
+void PreEventBuffer::push(const FrameDescriptor& frame)
+{
+    QMutexLocker locker(&mutex);
+
+    if(!enabled)
+        return;
+
+    // Frames closer than the largest rate allows are not kept
+    if(maximumFps > 0.0 && lastPushTime >= 0 && frame.captureTime - lastPushTime < 1000.0/maximumFps)
+        return;
+
+    if(hasPending)
+    {
+        skipped++;
+    }
+
+    pending = frame;
+    hasPending = true;
+    lastPushTime = frame.captureTime;
+    pendingCondition.wakeOne();
+}
+
+QList<CompressedFrame> PreEventBuffer::takeFrames()
+{
+    QMutexLocker locker(&mutex);
+
+    QList<CompressedFrame> taken;
+
+    while(!frames.isEmpty())
+    {
+        taken.append(frames.dequeue());
+    }
+
+    memory = 0;
+
+    return taken;
+}
+
+qint64 PreEventBuffer::memoryUsage() const
+{
+    QMutexLocker locker(&mutex);
+    return memory;
+}
+
+int PreEventBuffer::frameCount() const
+{
+    QMutexLocker locker(&mutex);
+    return frames.size();
+}
+
+qint64 PreEventBuffer::bufferedDuration() const
+{
+    QMutexLocker locker(&mutex);
+
+    if(frames.isEmpty())
+        return 0;
+
+    return frames.last().descriptor.captureTime - frames.first().descriptor.captureTime;
+}
+
+double PreEventBuffer::averageEncodeTime() const
+{
+    QMutexLocker locker(&mutex);
+    return encodeTime;
+}
+
+quint64 PreEventBuffer::skippedFrames() const
+{
+    QMutexLocker locker(&mutex);
+    return skipped;
+}
+
+void PreEventBuffer::run()
+{
+    QElapsedTimer timer;
+
+    forever
+    {
+        FrameDescriptor frame;
+        std::vector<int> parameters;
+
+        {
+            QMutexLocker locker(&mutex);
+
+            while(!hasPending && !abort)
+            {
+                pendingCondition.wait(&mutex);
+            }
+
+            if(abort)
+                break;
+
+            frame = pending;
+            pending = FrameDescriptor();
+            hasPending = false;
+
+            parameters.push_back(CV_IMWRITE_JPEG_QUALITY);
+            parameters.push_back(quality);
+        }
+
+        CompressedFrame compressed;
+        compressed.descriptor = frame;
+        compressed.descriptor.image = cv::Mat();
+
+        timer.start();
+
+        if(!cv::imencode(".jpg", frame.image, compressed.data, parameters))
+        {
+            qDebug()<<"Error compressing pre-event frame";
+            continue;
+        }
+
+        qint64 elapsed = timer.elapsed();
+
+        // Releases the decoded frame before taking the lock
+        frame.image.release();
+
+        QMutexLocker locker(&mutex);
+        encodeTime = frames.isEmpty() && encodeTime == 0.0 ? elapsed : encodeTime + smoothing*(elapsed - encodeTime);
+        memory += compressed.data.size();
+        frames.enqueue(compressed);
+        trim();
+    }
+}
+
+void PreEventBuffer::trim()
+{
+    while(!frames.isEmpty())
+    {
+        qint64 age = frames.last().descriptor.captureTime - frames.first().descriptor.captureTime;
+
+        if(memory <= memoryLimit && age <= 1000*(qint64)duration)
+            break;
+
+        memory -= frames.first().data.size();
+        frames.dequeue();
+    }
+}
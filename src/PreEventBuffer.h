@@ -0,0 +1,108 @@
+#ifndef PREEVENTBUFFER_H
+#define PREEVENTBUFFER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QList>
+
+#include <vector>
+
+#include "opencv2/core/core.hpp"
+
+#include "FrameDescriptor.h"
+
+/** @brief A frame kept compressed in memory */
+struct CompressedFrame
+{
+    /** Identity of the frame, without its pixels */
+    FrameDescriptor descriptor;
+    /** The frame encoded as JPEG */
+    std::vector<uchar> data;
+};
+
+/**
+ * @brief Keeps the last seconds of video compressed in memory, so a recording can start
+ * with what happened before it was started.
+ *
+ * Frames are compressed on its own thread. A frame arriving while the previous one is
+ * being compressed replaces it, and the rate of kept frames can be limited, which bounds
+ * the cost. The oldest frames are dropped past the duration or the memory limit.
+**/
+class PreEventBuffer : public QThread
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief This is the class constructor.
+     *
+     * @param  parent   Parent object
+    **/
+    PreEventBuffer(QObject* parent = NULL);
+    ~PreEventBuffer();
+
+    /** @brief Starts or stops keeping frames, stopping empties the buffer */
+    void setEnabled(bool enabled);
+    /** @brief Return true while frames are kept */
+    bool isEnabled() const;
+    /** @brief Sets the seconds of video kept */
+    void setDuration(int seconds);
+    /** @brief Sets the largest memory in bytes used by the compressed frames */
+    void setMemoryLimit(qint64 bytes);
+    /** @brief Sets the JPEG quality, from 0 to 100 */
+    void setQuality(int quality);
+    /** @brief Sets the largest rate of kept frames, 0 keeps every frame */
+    void setMaximumFps(double fps);
+
+    /**
+     * @brief Offers a frame to the buffer, it never waits for the compression.
+     *
+     * @param frame The frame, its pixels must not be modified afterwards
+     **/
+    void push(const FrameDescriptor& frame);
+    /** @brief Takes every kept frame, oldest first, and empties the buffer */
+    QList<CompressedFrame> takeFrames();
+
+    /** @brief Return the bytes used by the compressed frames */
+    qint64 memoryUsage() const;
+    /** @brief Return the number of kept frames */
+    int frameCount() const;
+    /** @brief Return the milliseconds between the oldest and newest kept frames */
+    qint64 bufferedDuration() const;
+    /** @brief Return the average time in milliseconds to compress a frame */
+    double averageEncodeTime() const;
+    /** @brief Return the number of frames replaced before they were compressed */
+    quint64 skippedFrames() const;
+
+protected:
+    /** @brief Compression loop, runs while enabled */
+    void run();
+
+private:
+    /** @brief Drops the oldest frames past the limits. The mutex must be locked. */
+    void trim();
+
+    /** @brief Weight of the last frame in the average compression time */
+    static const double smoothing;
+
+    mutable QMutex mutex;
+    QWaitCondition pendingCondition;
+    QQueue<CompressedFrame> frames;
+    FrameDescriptor pending;
+    bool hasPending;
+    bool enabled;
+    bool abort;
+
+    int duration;
+    qint64 memoryLimit;
+    int quality;
+    double maximumFps;
+
+    qint64 memory;
+    qint64 lastPushTime;
+    double encodeTime;
+    quint64 skipped;
+};
+
+#endif // PREEVENTBUFFER_H
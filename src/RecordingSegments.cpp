@@ -0,0 +1,130 @@
+#include "RecordingSegments.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QFile>
+#include <QMap>
+#include <QRegExp>
+#include <QDebug>
+
+RecordingSegments::RecordingSegments()
+{
+    segment = 1;
+    split = false;
+    maximumDuration = 0;
+    maximumSize = 0;
+    retention = 0;
+}
+
+void RecordingSegments::setLimits(int duration, qint64 size)
+{
+    QMutexLocker locker(&mutex);
+    maximumDuration = qMax(duration, 0);
+    maximumSize = qMax(size, (qint64)0);
+}
+
+void RecordingSegments::setRetention(qint64 size)
+{
+    QMutexLocker locker(&mutex);
+    retention = qMax(size, (qint64)0);
+}
+
+void RecordingSegments::start(const QString& basePath, const QString& extension)
+{
+    QMutexLocker locker(&mutex);
+    this->basePath = basePath;
+    this->extension = extension;
+    segment = 1;
+    split = maximumDuration > 0 || maximumSize > 0;
+}
+
+QString RecordingSegments::segmentPath() const
+{
+    QMutexLocker locker(&mutex);
+
+    // A recording that is not split keeps its plain name
+    if(!split)
+    {
+        return basePath;
+    }
+
+    return basePath + QString("_%1").arg(segment, 3, 10, QChar('0'));
+}
+
+QString RecordingSegments::segmentFile() const
+{
+    return segmentPath() + extension;
+}
+
+QString RecordingSegments::nextSegment()
+{
+    {
+        QMutexLocker locker(&mutex);
+        segment++;
+    }
+
+    return segmentPath();
+}
+
+bool RecordingSegments::isFull(qint64 duration, qint64 size) const
+{
+    QMutexLocker locker(&mutex);
+
+    if(!split)
+        return false;
+
+    return (maximumDuration > 0 && duration >= 1000*(qint64)maximumDuration) ||
+            (maximumSize > 0 && size >= maximumSize);
+}
+
+void RecordingSegments::enforceRetention() const
+{
+    QString current = QFileInfo(segmentPath()).fileName();
+    qint64 limit;
+    QString path;
+
+    {
+        QMutexLocker locker(&mutex);
+        limit = retention;
+        path = basePath;
+    }
+
+    if(limit <= 0)
+        return;
+
+    QDir directory = QFileInfo(path).dir();
+
+    // Only the files named by the recorder, grouped by segment with their subtitles, telemetry and index
+    QRegExp pattern("^(\\d{14}(_\\d{3})?)\\.(avi|mkv|srt|tel|idx)$");
+    QMap<QString, qint64> sizes;
+    QMap<QString, QStringList> files;
+    qint64 total = 0;
+
+    foreach(const QFileInfo& info, directory.entryInfoList(QDir::Files))
+    {
+        if(pattern.indexIn(info.fileName()) < 0)
+            continue;
+
+        QString name = pattern.cap(1);
+        sizes[name] += info.size();
+        files[name].append(info.absoluteFilePath());
+        total += info.size();
+    }
+
+    // The names start with the date and time, so the map keeps them oldest first
+    for(QMap<QString, qint64>::const_iterator i = sizes.constBegin(); i != sizes.constEnd() && total > limit; ++i)
+    {
+        if(i.key() == current)
+            continue;
+
+        foreach(const QString& file, files[i.key()])
+        {
+            if(!QFile::remove(file))
+            {
+                qDebug()<<"Error removing old recording"<<file;
+            }
+        }
+
+        total -= i.value();
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef RECORDINGSEGMENTS_H
+#define RECORDINGSEGMENTS_H
+
+#include <QString>
+#include <QMutex>
+
+/**
+ * @brief Splits a recording into segments of limited duration or size, and deletes the
+ * oldest recordings of the directory once they use more disk than allowed.
+ *
+ * The segments of a recording named yyyyMMddHHmmss are yyyyMMddHHmmss_001, _002, ...
+ * Each one has its own subtitles file next to it. The limits may be changed from any thread.
+**/
+class RecordingSegments
+{
+public:
+    /** @brief This is the class constructor. */
+    RecordingSegments();
+
+    /**
+     * @brief Sets when a segment is closed and the next one started.
+     *
+     * @param duration  Longest segment in seconds, 0 for no limit
+     * @param size      Largest segment in bytes, 0 for no limit
+     **/
+    void setLimits(int duration, qint64 size);
+    /**
+     * @brief Sets the disk used by the recordings of the directory before the oldest are deleted.
+     *
+     * @param size Bytes kept, 0 keeps every recording
+     **/
+    void setRetention(qint64 size);
+
+    /**
+     * @brief Starts a recording, its first segment is current.
+     *
+     * @param basePath  Path of the recording without extension
+     * @param extension Extension of the video files, with its dot
+     **/
+    void start(const QString& basePath, const QString& extension);
+    /** @brief Return the path without extension of the current segment */
+    QString segmentPath() const;
+    /** @brief Return the path of the video file of the current segment */
+    QString segmentFile() const;
+    /** @brief Makes the next segment current and return its path without extension */
+    QString nextSegment();
+    /**
+     * @brief Return true if the current segment reached one of the limits.
+     *
+     * @param duration  Milliseconds recorded in the segment
+     * @param size      Bytes written in the segment
+     **/
+    bool isFull(qint64 duration, qint64 size) const;
+    /** @brief Deletes the oldest recordings of the directory over the retention, never the current segment */
+    void enforceRetention() const;
+
+private:
+    mutable QMutex mutex;
+    QString basePath;
+    QString extension;
+    int segment;
+    /** True if the limits were set when the recording started */
+    bool split;
+    int maximumDuration;
+    qint64 maximumSize;
+    qint64 retention;
+};
+
+#endif // RECORDINGSEGMENTS_H
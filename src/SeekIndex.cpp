@@ -0,0 +1,171 @@
+#include "SeekIndex.h"
+
+#include <QDebug>
+
+#include <algorithm>
+
+/** @brief Orders the entries by capture time */
+static bool captureBefore(qint64 captureTime, const SeekIndex::Entry& entry)
+{
+    return captureTime < entry.captureTime;
+}
+
+/** @brief Orders the entries by sequence number */
+static bool sequenceBefore(quint64 sequence, const SeekIndex::Entry& entry)
+{
+    return sequence < entry.sequence;
+}
+
+SeekIndex::SeekIndex()
+{
+    rate = 0.0;
+    frames = 0;
+}
+
+SeekIndex::~SeekIndex()
+{
+    close();
+}
+
+QString SeekIndex::fileExtension()
+{
+    return ".idx";
+}
+
+bool SeekIndex::create(const QString& path, double fps)
+{
+    close();
+
+    file.setFileName(path);
+
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qDebug()<<"Error creating seek index"<<path;
+        return false;
+    }
+
+    stream.setDevice(&file);
+    stream.setByteOrder(QDataStream::LittleEndian);
+    stream.setFloatingPointPrecision(QDataStream::DoublePrecision);
+    stream.writeRawData("QIDX", 4);
+    stream << version << (quint16)entrySize << fps;
+
+    return true;
+}
+
+void SeekIndex::append(quint32 frame, qint64 captureTime, quint64 sequence)
+{
+    // The file is buffered, entries reach the disk in blocks
+    if(file.isOpen())
+    {
+        stream << frame << captureTime << sequence;
+    }
+}
+
+void SeekIndex::close()
+{
+    if(file.isOpen())
+    {
+        stream.setDevice(NULL);
+        file.close();
+    }
+}
+
+bool SeekIndex::load(const QString& path)
+{
+    clear();
+
+    QFile index(path);
+
+    if(!index.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream input(&index);
+    input.setByteOrder(QDataStream::LittleEndian);
+    input.setFloatingPointPrecision(QDataStream::DoublePrecision);
+
+    char magic[4];
+    quint16 fileVersion, size;
+    double fps;
+
+    if(input.readRawData(magic, 4) != 4 || qstrncmp(magic, "QIDX", 4) != 0)
+        return false;
+
+    input >> fileVersion >> size >> fps;
+
+    if(fileVersion != version || size < entrySize || fps <= 0.0)
+        return false;
+
+    entries.reserve((index.size() - headerSize)/size);
+
+    while(index.bytesAvailable() >= size)
+    {
+        Entry entry;
+        input >> entry.frame >> entry.captureTime >> entry.sequence;
+
+        // Later versions may add fields at the end
+        input.skipRawData(size - entrySize);
+        entries.append(entry);
+    }
+
+    rate = fps;
+    frames = entries.isEmpty() ? 0 : entries.last().frame + 1;
+
+    return true;
+}
+
+void SeekIndex::clear()
+{
+    entries.clear();
+    rate = 0.0;
+    frames = 0;
+}
+
+bool SeekIndex::isEmpty() const
+{
+    return entries.isEmpty();
+}
+
+double SeekIndex::fps() const
+{
+    return rate;
+}
+
+qint64 SeekIndex::frameCount() const
+{
+    return frames;
+}
+
+qint64 SeekIndex::duration() const
+{
+    return rate > 0.0 ? qRound64(frames*1000.0/rate) : 0;
+}
+
+qint64 SeekIndex::frameAtTime(qint64 time) const
+{
+    if(frames == 0)
+        return 0;
+
+    // The container has a fixed rate
+    return qBound((qint64)0, qRound64(time*rate/1000.0), frames - 1);
+}
+
+qint64 SeekIndex::frameAtCapture(qint64 captureTime) const
+{
+    if(entries.isEmpty())
+        return 0;
+
+    QVector<Entry>::const_iterator entry = std::upper_bound(entries.constBegin(), entries.constEnd(), captureTime, captureBefore);
+
+    return entry == entries.constBegin() ? entry->frame : (entry - 1)->frame;
+}
+
+qint64 SeekIndex::frameOfSequence(quint64 sequence) const
+{
+    if(entries.isEmpty())
+        return 0;
+
+    QVector<Entry>::const_iterator entry = std::upper_bound(entries.constBegin(), entries.constEnd(), sequence, sequenceBefore);
+
+    return entry == entries.constBegin() ? entry->frame : (entry - 1)->frame;
+}
@@ -0,0 +1,86 @@
+#ifndef SEEKINDEX_H
+#define SEEKINDEX_H
+
+#include <QString>
+#include <QVector>
+#include <QFile>
+#include <QDataStream>
+
+/**
+ * @brief Index of a recorded video, maps capture times and sequence numbers to frame numbers.
+ *
+ * The recorder repeats and drops frames to keep the rate of the container, so the frames of the
+ * file can not be found from the telemetry without it. The file starts with the magic "QIDX",
+ * the version, the size of an entry and the rate of the video, followed by one little endian
+ * entry per captured frame, in the order they were written.
+**/
+class SeekIndex
+{
+public:
+    /** @brief A captured frame and the first frame of the file that shows it */
+    struct Entry
+    {
+        quint32 frame;
+        qint64 captureTime;
+        quint64 sequence;
+    };
+
+    SeekIndex();
+    ~SeekIndex();
+
+    /** @brief Return the extension of the index files, with its dot */
+    static QString fileExtension();
+
+    /**
+     * @brief Starts writing an index, the entries are added as the frames are encoded.
+     *
+     * @param path  The path of the index file
+     * @param fps   The rate of the video
+     * @return False if the file can not be created
+     **/
+    bool create(const QString& path, double fps);
+    /** @brief Adds the entry of a captured frame, first written as the frame number of the file */
+    void append(quint32 frame, qint64 captureTime, quint64 sequence);
+    /** @brief Ends writing the index */
+    void close();
+
+    /**
+     * @brief Reads an index file.
+     *
+     * @param path The path of the index file
+     * @return False if the file can not be read or is not an index
+     **/
+    bool load(const QString& path);
+    /** @brief Forgets the loaded entries */
+    void clear();
+    /** @brief Return true if no entries are loaded */
+    bool isEmpty() const;
+    /** @brief Return the rate of the indexed video */
+    double fps() const;
+    /** @brief Return the number of frames of the indexed video */
+    qint64 frameCount() const;
+    /** @brief Return the duration of the indexed video in milliseconds */
+    qint64 duration() const;
+    /** @brief Return the frame shown at a time of the video in milliseconds */
+    qint64 frameAtTime(qint64 time) const;
+    /** @brief Return the frame that shows a capture time, or the last one captured before it */
+    qint64 frameAtCapture(qint64 captureTime) const;
+    /** @brief Return the frame that shows a sequence number, or the last one captured before it */
+    qint64 frameOfSequence(quint64 sequence) const;
+
+private:
+    static const quint16 version = 1;
+    static const int entrySize = 20;
+    static const int headerSize = 16;
+
+    /** File being written */
+    QFile file;
+    QDataStream stream;
+
+    /** Loaded entries, ordered by frame, capture time and sequence */
+    QVector<Entry> entries;
+    double rate;
+    qint64 frames;
+};
+
+#endif // SEEKINDEX_H
@@ -0,0 +1,417 @@
+#include "StreamRemuxer.h"
+
+#include <QDebug>
+#include <QElapsedTimer>
+
+#if USE_FFMPEG
+extern "C" {
+#include <libavformat/avformat.h>
+}
+#endif
+
+StreamRemuxer::StreamRemuxer(QObject* parent)
+    : QThread(parent)
+{
+    position = 0.0;
+    abort = false;
+    recording = false;
+    packets = 0;
+    bytes = 0;
+    openClockTime = 0;
+
+#if USE_FFMPEG
+#if LIBAVFORMAT_VERSION_MAJOR < 58
+    av_register_all();
+#endif
+    avformat_network_init();
+#endif
+}
+
+StreamRemuxer::~StreamRemuxer()
+{
+    close();
+    wait();
+
+#if USE_FFMPEG
+    avformat_network_deinit();
+#endif
+}
+
+bool StreamRemuxer::isAvailable()
+{
+#if USE_FFMPEG
+    return true;
+#else
+    return false;
+#endif
+}
+
+QString StreamRemuxer::fileExtension()
+{
+    return ".mkv";
+}
+
+void StreamRemuxer::open(const QString& url, const QString& path, double position, qint64 clockTime)
+{
+    close();
+    wait();
+
+    segments.start(path, fileExtension());
+
+    QMutexLocker locker(&mutex);
+    this->url = url;
+    this->position = position;
+    abort = false;
+    recording = true;
+    packets = 0;
+    bytes = 0;
+    openClockTime = clockTime;
+    openClock.start();
+    segmentStarts.clear();
+
+    start(QThread::LowPriority);
+}
+
+RecordingSegments& StreamRemuxer::recordingSegments()
+{
+    return segments;
+}
+
+void StreamRemuxer::close()
+{
+    QMutexLocker locker(&mutex);
+    abort = true;
+}
+
+bool StreamRemuxer::isRecording() const
+{
+    QMutexLocker locker(&mutex);
+    return recording;
+}
+
+void StreamRemuxer::appendTelemetry(const TelemetryRecord& record)
+{
+    QMutexLocker locker(&mutex);
+
+    // The records arrive in capture order, so a log ends at the first record of the next segment
+    while(!segmentStarts.isEmpty() && segmentStarts.first().clockTime <= record.captureTime)
+    {
+        // The subtitles of the file count from its first key frame
+        telemetry.open(segmentStarts.first().path + TelemetryLog::fileExtension(), segmentStarts.first().clockTime);
+        segmentStarts.removeFirst();
+    }
+
+    telemetry.append(record);
+}
+
+void StreamRemuxer::startSegment()
+{
+    SegmentStart segment;
+    segment.path = segments.segmentPath();
+    segment.clockTime = openClockTime + openClock.elapsed();
+
+    QMutexLocker locker(&mutex);
+    segmentStarts.append(segment);
+}
+
+quint64 StreamRemuxer::writtenPackets() const
+{
+    QMutexLocker locker(&mutex);
+    return packets;
+}
+
+quint64 StreamRemuxer::writtenBytes() const
+{
+    QMutexLocker locker(&mutex);
+    return bytes;
+}
+
+#if USE_FFMPEG
+
+int StreamRemuxer::interruptCallback(void* remuxer)
+{
+    StreamRemuxer* self = static_cast<StreamRemuxer*>(remuxer);
+
+    QMutexLocker locker(&self->mutex);
+    return self->abort ? 1 : 0;
+}
+
+bool StreamRemuxer::openOutput(AVFormatContext* input, AVFormatContext** output, QVector<int>& streamMap)
+{
+    QString path = segments.segmentFile();
+
+    if(avformat_alloc_output_context2(output, NULL, "matroska", path.toLocal8Bit().data()) < 0)
+    {
+        return false;
+    }
+
+    streamMap.fill(-1, input->nb_streams);
+    int count = 0;
+
+    for(unsigned int i = 0; i < input->nb_streams; i++)
+    {
+        AVCodecParameters* parameters = input->streams[i]->codecpar;
+
+        if(parameters->codec_type != AVMEDIA_TYPE_VIDEO && parameters->codec_type != AVMEDIA_TYPE_AUDIO)
+            continue;
+
+        AVStream* stream = avformat_new_stream(*output, NULL);
+
+        if(stream == NULL || avcodec_parameters_copy(stream->codecpar, parameters) < 0)
+        {
+            return false;
+        }
+
+        // The tag of the source container may not be valid in the recording
+        stream->codecpar->codec_tag = 0;
+        streamMap[i] = count++;
+    }
+
+    if(!((*output)->oformat->flags & AVFMT_NOFILE) && avio_open(&(*output)->pb, path.toLocal8Bit().data(), AVIO_FLAG_WRITE) < 0)
+    {
+        return false;
+    }
+
+    if(avformat_write_header(*output, NULL) < 0)
+    {
+        return false;
+    }
+
+    emit segmentStarted(segments.segmentPath());
+
+    return true;
+}
+
+void StreamRemuxer::closeOutput(AVFormatContext* output, bool finalize)
+{
+    if(output == NULL)
+        return;
+
+    if(finalize)
+    {
+        av_write_trailer(output);
+    }
+
+    if(!(output->oformat->flags & AVFMT_NOFILE))
+    {
+        avio_closep(&output->pb);
+    }
+
+    avformat_free_context(output);
+}
+
+void StreamRemuxer::run()
+{
+    AVFormatContext* input = avformat_alloc_context();
+    input->interrupt_callback.callback = interruptCallback;
+    input->interrupt_callback.opaque = this;
+
+    AVDictionary* options = NULL;
+
+    if(url.startsWith("rtsp://"))
+    {
+        // Lost packets would corrupt the recording
+        av_dict_set(&options, "rtsp_transport", "tcp", 0);
+    }
+
+    int result = avformat_open_input(&input, url.toLatin1().data(), NULL, &options);
+    av_dict_free(&options);
+
+    if(result < 0 || avformat_find_stream_info(input, NULL) < 0)
+    {
+        qDebug()<<"Error opening source for pass-through recording"<<url;
+        emit error(tr("Error al abrir %1 para grabar").arg(url));
+
+        avformat_close_input(&input);
+
+        QMutexLocker locker(&mutex);
+        recording = false;
+        return;
+    }
+
+    // A file is read far faster than it is shown, it is paced to its timestamps
+    bool live = url.contains("://");
+
+    // A file is recorded from where it is being shown
+    if(!live && position > 0.0)
+    {
+        av_seek_frame(input, -1, (int64_t)(position*1000.0), AVSEEK_FLAG_BACKWARD);
+    }
+
+    AVFormatContext* output = NULL;
+    QVector<int> streamMap;
+
+    if(!openOutput(input, &output, streamMap))
+    {
+        qDebug()<<"Error opening pass-through recording"<<segments.segmentFile();
+        emit error(tr("Error al grabar video %1").arg(segments.segmentFile()));
+
+        closeOutput(output, false);
+        avformat_close_input(&input);
+
+        QMutexLocker locker(&mutex);
+        recording = false;
+        return;
+    }
+
+    int videoStream = av_find_best_stream(input, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    QVector<int64_t> lastDts(input->nb_streams, AV_NOPTS_VALUE);
+    bool started = false;
+
+    // Start and size of the current segment, it only ends on a key frame
+    AVRational milliseconds = {1, 1000};
+    int64_t segmentStart = AV_NOPTS_VALUE;
+    qint64 segmentBytes = 0;
+    bool segmentAnnounced = false;
+
+    // Offset from the timestamps of the file to the clock, set on the first video packet
+    QElapsedTimer clock;
+    clock.start();
+    qint64 streamOffset = 0;
+    bool synchronized = false;
+
+    AVPacket* packet = av_packet_alloc();
+
+    // Stops on close() through the interrupt callback, or when the source ends
+    while(av_read_frame(input, packet) >= 0)
+    {
+        int index = packet->stream_index;
+
+        // Starts on a key frame so the recording can be decoded from its beginning
+        if(!started)
+        {
+            started = videoStream < 0 || (index == videoStream && (packet->flags & AV_PKT_FLAG_KEY));
+        }
+
+        if(!started || streamMap[index] < 0)
+        {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        // Muxers reject timestamps going backwards, which some cameras send
+        if(packet->dts != AV_NOPTS_VALUE)
+        {
+            if(lastDts[index] != AV_NOPTS_VALUE && packet->dts <= lastDts[index])
+            {
+                av_packet_unref(packet);
+                continue;
+            }
+
+            lastDts[index] = packet->dts;
+        }
+
+        AVStream* inputStream = input->streams[index];
+
+        if(index == videoStream && packet->dts != AV_NOPTS_VALUE)
+        {
+            int64_t time = av_rescale_q(packet->dts, inputStream->time_base, milliseconds);
+
+            if(!live)
+            {
+                if(!synchronized)
+                {
+                    streamOffset = clock.elapsed() - time;
+                    synchronized = true;
+                }
+
+                // In short steps, so close() does not wait for a long gap of the file
+                qint64 wait = time + streamOffset - clock.elapsed();
+
+                while(wait > 0)
+                {
+                    {
+                        QMutexLocker locker(&mutex);
+
+                        if(abort)
+                            break;
+                    }
+
+                    msleep(qMin(wait, (qint64)pacingStep));
+                    wait = time + streamOffset - clock.elapsed();
+                }
+            }
+
+            if(segmentStart == AV_NOPTS_VALUE)
+            {
+                segmentStart = time;
+            }
+            else if((packet->flags & AV_PKT_FLAG_KEY) && segments.isFull(time - segmentStart, segmentBytes))
+            {
+                closeOutput(output, true);
+                output = NULL;
+                segments.enforceRetention();
+                segments.nextSegment();
+
+                if(!openOutput(input, &output, streamMap))
+                {
+                    qDebug()<<"Error opening pass-through recording"<<segments.segmentFile();
+                    emit error(tr("Error al grabar video %1").arg(segments.segmentFile()));
+
+                    closeOutput(output, false);
+                    output = NULL;
+                    av_packet_unref(packet);
+                    break;
+                }
+
+                segmentStart = time;
+                segmentBytes = 0;
+                segmentAnnounced = false;
+            }
+        }
+
+        AVStream* outputStream = output->streams[streamMap[index]];
+
+        av_packet_rescale_ts(packet, inputStream->time_base, outputStream->time_base);
+        packet->stream_index = streamMap[index];
+        packet->pos = -1;
+
+        // The first packet of a segment is a key frame, its log starts at the time it was read
+        if(!segmentAnnounced)
+        {
+            startSegment();
+            segmentAnnounced = true;
+        }
+
+        int size = packet->size;
+
+        if(av_interleaved_write_frame(output, packet) < 0)
+        {
+            qDebug()<<"Error writing packet to"<<segments.segmentFile();
+        }
+        else
+        {
+            segmentBytes += size;
+
+            QMutexLocker locker(&mutex);
+            packets++;
+            bytes += size;
+        }
+
+        av_packet_unref(packet);
+    }
+
+    av_packet_free(&packet);
+
+    closeOutput(output, true);
+    avformat_close_input(&input);
+    segments.enforceRetention();
+
+    QMutexLocker locker(&mutex);
+    recording = false;
+    segmentStarts.clear();
+    telemetry.close();
+}
+
+#else
+
+void StreamRemuxer::run()
+{
+    qDebug()<<"Pass-through recording needs FFmpeg, build with CONFIG+=ffmpeg";
+    emit error(tr("Grabacion sin recodificar no disponible"));
+
+    QMutexLocker locker(&mutex);
+    recording = false;
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef STREAMREMUXER_H
+#define STREAMREMUXER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+#include <QList>
+#include <QElapsedTimer>
+
+#include "RecordingSegments.h"
+#include "TelemetryLog.h"
+
+#if USE_FFMPEG
+struct AVFormatContext;
+#endif
+
+/**
+ * @brief Records the compressed packets of a source straight to disk, without decoding
+ * and encoding them again.
+ *
+ * The packets are read through a second connection to the source, since the decoder of
+ * OpenCV does not give access to them. Needs FFmpeg, see isAvailable().
+ *
+ * The telemetry of the frames shown is logged next to each segment. A segment starts when
+ * its first packet is read, the records captured from then on go to its log.
+**/
+class StreamRemuxer : public QThread
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief This is the class constructor.
+     *
+     * @param  parent   Parent object
+    **/
+    StreamRemuxer(QObject* parent = NULL);
+    ~StreamRemuxer();
+
+    /** @brief Return true if the application was built with FFmpeg */
+    static bool isAvailable();
+    /** @brief Return the extension of the files written, the container takes any codec */
+    static QString fileExtension();
+
+    /**
+     * @brief Starts recording a source in the background, stopping the previous recording.
+     *
+     * @param url       The URL or file path of the video
+     * @param path      The path of the recording without extension, segments add a number to it
+     * @param position  Position in milliseconds where a file starts to be recorded
+     * @param clockTime Time of the capture clock now, the segments start in its time
+     **/
+    void open(const QString& url, const QString& path, double position, qint64 clockTime);
+    /** @brief Return the limits of the segments of the recordings and of the disk they use */
+    RecordingSegments& recordingSegments();
+    /** @brief Stops the recording and finalizes the file */
+    void close();
+    /** @brief Return true while packets are being recorded */
+    bool isRecording() const;
+    /**
+     * @brief Logs the telemetry of a frame shown, in the segment recording at its capture time.
+     *
+     * @param record The telemetry, stamped with the capture time of the frame
+     **/
+    void appendTelemetry(const TelemetryRecord& record);
+
+    /** @brief Return the number of packets written since open() */
+    quint64 writtenPackets() const;
+    /** @brief Return the number of bytes written since open() */
+    quint64 writtenBytes() const;
+
+signals:
+    /** @brief Emit when the source or the file can not be opened */
+    void error(QString message);
+    /** @brief Emit when a segment of the recording starts, with its path without extension */
+    void segmentStarted(QString path);
+
+protected:
+    /** @brief Copies packets until close() is called or the source ends */
+    void run();
+
+private:
+#if USE_FFMPEG
+    /** @brief Lets FFmpeg give up a blocking read once the recording is stopped */
+    static int interruptCallback(void* remuxer);
+    /** @brief Creates the file of the current segment with a stream for each audio and video stream of the input */
+    bool openOutput(AVFormatContext* input, AVFormatContext** output, QVector<int>& streamMap);
+    /** @brief Finalizes and frees an output, it can be partially opened */
+    static void closeOutput(AVFormatContext* output, bool finalize);
+#endif
+    /** @brief Start of a segment, the records captured from then on go to its log */
+    struct SegmentStart
+    {
+        QString path;
+        qint64 clockTime;
+    };
+
+    /** @brief Announces the current segment once its first packet is written */
+    void startSegment();
+
+    /** @brief Longest sleep in milliseconds while a file is paced, close() waits at most this */
+    static const int pacingStep = 50;
+
+    QString url;
+    RecordingSegments segments;
+    double position;
+
+    mutable QMutex mutex;
+    bool abort;
+    bool recording;
+    quint64 packets;
+    quint64 bytes;
+
+    /** Capture clock when open() was called and the time elapsed since, together the capture clock of the thread */
+    qint64 openClockTime;
+    QElapsedTimer openClock;
+    /** Segments started by the thread, taken by appendTelemetry() */
+    QList<SegmentStart> segmentStarts;
+    /** Telemetry of the segment recording, guarded by the mutex */
+    TelemetryLog telemetry;
+};
+
+#endif // STREAMREMUXER_H
@@ -0,0 +1,165 @@
+#include "StreamWorkerPool.h"
+
+#include <QThread>
+#include <QDebug>
+
+const double StreamWorkerPool::smoothing = 1.0/8.0;
+
+StreamWorkerPool::StreamWorkerPool(int maximumThreads, QObject* parent)
+    : QObject(parent)
+{
+    if(maximumThreads <= 0)
+    {
+        maximumThreads = qMax(1, QThread::idealThreadCount() - 1);
+    }
+
+    pool.setMaxThreadCount(maximumThreads);
+    nextStream = 0;
+    budgetClock.start();
+}
+
+StreamWorkerPool::~StreamWorkerPool()
+{
+    pool.waitForDone();
+}
+
+int StreamWorkerPool::addStream(int budget)
+{
+    QMutexLocker locker(&mutex);
+
+    StreamState state;
+    state.budget = budget;
+    streams.insert(nextStream, state);
+
+    return nextStream++;
+}
+
+void StreamWorkerPool::removeStream(int stream)
+{
+    waitForStream(stream);
+
+    QMutexLocker locker(&mutex);
+    streams.remove(stream);
+}
+
+void StreamWorkerPool::setStreamBudget(int stream, int budget)
+{
+    QMutexLocker locker(&mutex);
+
+    if(streams.contains(stream))
+    {
+        streams[stream].budget = budget;
+    }
+}
+
+bool StreamWorkerPool::submit(int stream, QRunnable* job)
+{
+    {
+        QMutexLocker locker(&mutex);
+
+        if(!streams.contains(stream))
+        {
+            delete job;
+            return false;
+        }
+
+        // Budgets are renewed every second
+        if(budgetClock.elapsed() >= 1000)
+        {
+            for(QMap<int, StreamState>::iterator i = streams.begin(); i != streams.end(); ++i)
+            {
+                i.value().spent = 0;
+            }
+
+            budgetClock.restart();
+        }
+
+        StreamState& state = streams[stream];
+
+        if(state.busy || state.spent >= budgetOf(state))
+        {
+            state.skipped++;
+            delete job;
+            return false;
+        }
+
+        state.busy = true;
+        state.submitted++;
+    }
+
+    job->setAutoDelete(true);
+    pool.start(job);
+
+    return true;
+}
+
+void StreamWorkerPool::jobFinished(int stream, qint64 cost)
+{
+    QMutexLocker locker(&mutex);
+
+    if(streams.contains(stream))
+    {
+        StreamState& state = streams[stream];
+        state.busy = false;
+        state.spent += cost;
+        state.cost = state.submitted == 1 ? cost : state.cost + smoothing*(cost - state.cost);
+    }
+
+    idleCondition.wakeAll();
+}
+
+void StreamWorkerPool::waitForStream(int stream)
+{
+    QMutexLocker locker(&mutex);
+
+    while(streams.contains(stream) && streams[stream].busy)
+    {
+        idleCondition.wait(&mutex);
+    }
+}
+
+int StreamWorkerPool::threadCount() const
+{
+    return pool.maxThreadCount();
+}
+
+int StreamWorkerPool::streamCount() const
+{
+    QMutexLocker locker(&mutex);
+    return streams.size();
+}
+
+int StreamWorkerPool::streamBudget(int stream) const
+{
+    QMutexLocker locker(&mutex);
+    return streams.contains(stream) ? budgetOf(streams[stream]) : 0;
+}
+
+double StreamWorkerPool::averageCost(int stream) const
+{
+    QMutexLocker locker(&mutex);
+    return streams.contains(stream) ? streams[stream].cost : 0.0;
+}
+
+quint64 StreamWorkerPool::submittedJobs(int stream) const
+{
+    QMutexLocker locker(&mutex);
+    return streams.contains(stream) ? streams[stream].submitted : 0;
+}
+
+quint64 StreamWorkerPool::skippedJobs(int stream) const
+{
+    QMutexLocker locker(&mutex);
+    return streams.contains(stream) ? streams[stream].skipped : 0;
+}
+
+int StreamWorkerPool::budgetOf(const StreamState& state) const
+{
+    if(state.budget > 0)
+    {
+        return state.budget;
+    }
+
+    // An even share of every worker thread
+    return 1000*pool.maxThreadCount()/qMax(1, streams.size());
+}
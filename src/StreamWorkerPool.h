@@ -0,0 +1,113 @@
+#ifndef STREAMWORKERPOOL_H
+#define STREAMWORKERPOOL_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QMap>
+
+/**
+ * @brief Worker threads shared by several video streams to process their frames.
+ *
+ * Each stream has at most one job running, a frame arriving meanwhile is skipped, so a
+ * slow stream drops frames instead of queueing them. Each stream also has a budget of
+ * worker time per second; once it is spent the frames of that stream are skipped until
+ * the next second, so a costly stream can not starve the others.
+**/
+class StreamWorkerPool : public QObject
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief This is the class constructor.
+     *
+     * @param  maximumThreads   Number of worker threads, 0 leaves one core to the interface
+     * @param  parent           Parent object
+    **/
+    StreamWorkerPool(int maximumThreads = 0, QObject* parent = NULL);
+    ~StreamWorkerPool();
+
+    /**
+     * @brief Registers a stream.
+     *
+     * @param budget Milliseconds of worker time per second, 0 shares the pool evenly
+     * @return The identifier of the stream
+     **/
+    int addStream(int budget = 0);
+    /** @brief Unregisters a stream, waiting for its running job */
+    void removeStream(int stream);
+    /**
+     * @brief Changes the budget of a stream.
+     *
+     * @param stream    The identifier of the stream
+     * @param budget    Milliseconds of worker time per second, 0 shares the pool evenly
+     **/
+    void setStreamBudget(int stream, int budget);
+    /**
+     * @brief Runs a job for a stream unless it has one running or has spent its budget.
+     * The job is deleted once run, or right away when it is skipped.
+     *
+     * @param stream    The identifier of the stream
+     * @param job       The job, must call jobFinished() at its end
+     * @return True if the job was started
+     **/
+    bool submit(int stream, QRunnable* job);
+    /**
+     * @brief Reports the end of the job of a stream. Called from the worker thread.
+     *
+     * @param stream    The identifier of the stream
+     * @param cost      Time in milliseconds the job took
+     **/
+    void jobFinished(int stream, qint64 cost);
+    /** @brief Waits until the stream has no job running */
+    void waitForStream(int stream);
+
+    /** @brief Return the number of worker threads */
+    int threadCount() const;
+    /** @brief Return the number of registered streams */
+    int streamCount() const;
+    /** @brief Return the milliseconds of worker time per second the stream may use */
+    int streamBudget(int stream) const;
+    /** @brief Return the average time in milliseconds of the jobs of the stream */
+    double averageCost(int stream) const;
+    /** @brief Return the number of jobs started for the stream */
+    quint64 submittedJobs(int stream) const;
+    /** @brief Return the number of jobs skipped because the stream was busy or out of budget */
+    quint64 skippedJobs(int stream) const;
+
+private:
+    /** @brief Scheduling state of a stream */
+    struct StreamState
+    {
+        StreamState() : budget(0), busy(false), spent(0), cost(0.0), submitted(0), skipped(0) {}
+
+        /** Milliseconds of worker time per second, 0 for an even share */
+        int budget;
+        /** True while a job of the stream is running */
+        bool busy;
+        /** Milliseconds of worker time used in the current second */
+        qint64 spent;
+        /** Average time of the jobs */
+        double cost;
+        quint64 submitted;
+        quint64 skipped;
+    };
+
+    /** @brief Return the budget of a stream, resolving the even share. The mutex must be locked. */
+    int budgetOf(const StreamState& state) const;
+
+    /** @brief Weight of the last job in the average cost */
+    static const double smoothing;
+
+    QThreadPool pool;
+    mutable QMutex mutex;
+    QWaitCondition idleCondition;
+    QMap<int, StreamState> streams;
+    QElapsedTimer budgetClock;
+    int nextStream;
+};
+
+#endif // STREAMWORKERPOOL_H
@@ -0,0 +1,299 @@
+#include "TelemetryLog.h"
+
+#include <QDataStream>
+#include <QTextStream>
+#include <QFileInfo>
+#include <QDebug>
+
+#include "SeekIndex.h"
+
+/** @brief Formats milliseconds as a subtitle time */
+static QString subTitleTime(qint64 time)
+{
+    time = qMax(time, (qint64)0);
+
+    return QString("%1:%2:%3,%4")
+            .arg(time/3600000, 2, 10, QChar('0'))
+            .arg((time/60000)%60, 2, 10, QChar('0'))
+            .arg((time/1000)%60, 2, 10, QChar('0'))
+            .arg(time%1000, 3, 10, QChar('0'));
+}
+
+/** @brief Return the time of the video in milliseconds where a record is shown */
+static qint64 videoTime(const TelemetryRecord& record, qint64 videoStart, const SeekIndex& index)
+{
+    if(index.isEmpty())
+        return record.captureTime - videoStart;
+
+    // The file has a fixed rate and no gaps, unlike the capture
+    return qRound64(index.frameAtCapture(record.captureTime)*1000.0/index.fps());
+}
+
+TelemetryLog::TelemetryLog(QObject* parent)
+    : QThread(parent)
+{
+    abort = false;
+    records = 0;
+
+    // Writing must not take the time of the display
+    start(QThread::LowPriority);
+}
+
+TelemetryLog::~TelemetryLog()
+{
+    close();
+
+    {
+        QMutexLocker locker(&mutex);
+        abort = true;
+        flushCondition.wakeAll();
+    }
+
+    wait();
+}
+
+QString TelemetryLog::fileExtension()
+{
+    return ".tel";
+}
+
+void TelemetryLog::open(const QString& path, qint64 videoStart)
+{
+    QMutexLocker locker(&mutex);
+
+    if(!batches.isEmpty())
+    {
+        batches.last().last = true;
+        flushCondition.wakeAll();
+    }
+
+    Batch batch;
+    batch.path = path;
+    batch.videoStart = videoStart;
+    batch.last = false;
+    batches.append(batch);
+    records = 0;
+}
+
+void TelemetryLog::close()
+{
+    QMutexLocker locker(&mutex);
+
+    if(!batches.isEmpty() && !batches.last().last)
+    {
+        batches.last().last = true;
+        flushCondition.wakeAll();
+    }
+}
+
+void TelemetryLog::append(const TelemetryRecord& record)
+{
+    QMutexLocker locker(&mutex);
+
+    if(batches.isEmpty() || batches.last().last)
+        return;
+
+    QDataStream stream(&batches.last().data, QIODevice::WriteOnly | QIODevice::Append);
+    stream.setByteOrder(QDataStream::LittleEndian);
+    stream.setFloatingPointPrecision(QDataStream::DoublePrecision);
+    stream << record.sequence << record.captureTime << record.groundTime
+           << record.latitude << record.longitude << record.altitude
+           << record.battery << record.airSpeed;
+
+    records++;
+
+    if(batches.last().data.size() >= flushRecords*recordSize)
+    {
+        flushCondition.wakeAll();
+    }
+}
+
+quint64 TelemetryLog::recordCount() const
+{
+    QMutexLocker locker(&mutex);
+    return records;
+}
+
+void TelemetryLog::run()
+{
+    forever
+    {
+        QList<Batch> pending;
+        bool stop;
+
+        {
+            QMutexLocker locker(&mutex);
+
+            if(!abort)
+            {
+                flushCondition.wait(&mutex, flushInterval);
+            }
+
+            // The open batch stays to gather more records, only its data is taken
+            for(int i = 0; i < batches.size(); i++)
+            {
+                pending.append(batches[i]);
+                batches[i].data.clear();
+            }
+
+            while(!batches.isEmpty() && (batches.first().last || batches.size() > 1))
+            {
+                batches.removeFirst();
+            }
+
+            stop = abort;
+        }
+
+        writeBatches(pending);
+
+        if(stop)
+            break;
+    }
+
+    file.close();
+}
+
+void TelemetryLog::writeBatches(const QList<Batch>& pending)
+{
+    for(int i = 0; i < pending.size(); i++)
+    {
+        const Batch& batch = pending[i];
+
+        if(file.fileName() != batch.path || !file.isOpen())
+        {
+            file.close();
+            file.setFileName(batch.path);
+
+            if(!file.open(QIODevice::WriteOnly | QIODevice::Append))
+            {
+                qDebug()<<"Error opening telemetry log"<<batch.path;
+                continue;
+            }
+
+            if(file.size() == 0)
+            {
+                QDataStream stream(&file);
+                stream.setByteOrder(QDataStream::LittleEndian);
+                stream.writeRawData("QTEL", 4);
+                stream << version << (quint16)recordSize << (qint64)batch.videoStart;
+            }
+        }
+
+        if(!batch.data.isEmpty() && file.write(batch.data) != batch.data.size())
+        {
+            qDebug()<<"Error writing telemetry log"<<batch.path;
+        }
+
+        if(batch.last)
+        {
+            file.close();
+        }
+    }
+
+    if(file.isOpen())
+    {
+        file.flush();
+    }
+}
+
+bool TelemetryLog::readRecords(const QString& path, QVector<TelemetryRecord>& records, qint64* videoStart)
+{
+    QFile log(path);
+
+    if(!log.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&log);
+    stream.setByteOrder(QDataStream::LittleEndian);
+    stream.setFloatingPointPrecision(QDataStream::DoublePrecision);
+
+    char magic[4];
+    quint16 fileVersion, size;
+    qint64 start;
+
+    if(stream.readRawData(magic, 4) != 4 || qstrncmp(magic, "QTEL", 4) != 0)
+        return false;
+
+    stream >> fileVersion >> size >> start;
+
+    if(fileVersion != version || size < recordSize)
+        return false;
+
+    if(videoStart != NULL)
+    {
+        *videoStart = start;
+    }
+
+    records.clear();
+    records.reserve((log.size() - headerSize)/size);
+
+    while(log.bytesAvailable() >= size)
+    {
+        TelemetryRecord record;
+        stream >> record.sequence >> record.captureTime >> record.groundTime
+               >> record.latitude >> record.longitude >> record.altitude
+               >> record.battery >> record.airSpeed;
+
+        // Later versions may add fields at the end
+        stream.skipRawData(size - recordSize);
+        records.append(record);
+    }
+
+    return true;
+}
+
+bool TelemetryLog::exportSubTitles(const QString& path, const QString& srtPath, int interval)
+{
+    QVector<TelemetryRecord> records;
+    qint64 videoStart;
+
+    if(!readRecords(path, records, &videoStart))
+        return false;
+
+    QFile srt(srtPath);
+
+    if(!srt.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    if(records.isEmpty())
+        return true;
+
+    if(videoStart < 0)
+    {
+        videoStart = records.first().captureTime;
+    }
+
+    QFileInfo info(path);
+    SeekIndex index;
+    index.load(info.path() + "/" + info.completeBaseName() + SeekIndex::fileExtension());
+
+    QTextStream streamData(&srt);
+    int count = 1;
+    qint64 nextTime = 0;
+
+    for(int i = 0; i < records.size(); i++)
+    {
+        const TelemetryRecord& record = records[i];
+        qint64 time = videoTime(record, videoStart, index);
+
+        if(time < nextTime)
+            continue;
+
+        // Shown until the next record, or one interval for the last one
+        qint64 end = i + 1 < records.size() ? videoTime(records[i + 1], videoStart, index) : time + qMax(interval, 1);
+        end = qMax(end, time + interval);
+
+        streamData
+                << count << "\r\n"
+                << subTitleTime(time) << " --> " << subTitleTime(end) << "\r\n"
+                << "<i>Lat: " << QString::number(record.latitude, 'f', 6)
+                << " - Lon: " << QString::number(record.longitude, 'f', 6)
+                << " - Alt: " << QString::number(record.altitude, 'f', 2) << "</i>\r\n"
+                << "\r\n";
+
+        count++;
+        nextTime = time + interval;
+    }
+
+    return streamData.status() == QTextStream::Ok;
+}
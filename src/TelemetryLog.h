@@ -0,0 +1,125 @@
+#ifndef TELEMETRYLOG_H
+#define TELEMETRYLOG_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QList>
+#include <QVector>
+#include <QByteArray>
+#include <QString>
+#include <QFile>
+
+/** @brief Telemetry at the time a frame was recorded */
+struct TelemetryRecord
+{
+    TelemetryRecord()
+        : sequence(0), captureTime(0), groundTime(0),
+        latitude(0.0), longitude(0.0), altitude(0.0), battery(0.0), airSpeed(0.0) {}
+
+    /** Sequence number of the frame */
+    quint64 sequence;
+    /** Capture time of the frame in milliseconds */
+    qint64 captureTime;
+    /** UTC time in milliseconds since the epoch */
+    quint64 groundTime;
+    double latitude;
+    double longitude;
+    double altitude;
+    double battery;
+    double airSpeed;
+};
+
+/**
+ * @brief Append-only binary log with the telemetry of every recorded frame.
+ *
+ * The file starts with the magic "QTEL", the version, the size of a record and the capture
+ * time where the video starts, followed by fixed size little endian records. Records are
+ * gathered in memory and written in batches on its own thread.
+**/
+class TelemetryLog : public QThread
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief This is the class constructor.
+     *
+     * @param  parent   Parent object
+    **/
+    TelemetryLog(QObject* parent = NULL);
+    ~TelemetryLog();
+
+    /** @brief Return the extension of the log files, with its dot */
+    static QString fileExtension();
+
+    /**
+     * @brief Starts a log file, the records appended before go to the previous file.
+     *
+     * @param path      The path of the log file
+     * @param videoStart Capture time of the first frame of the video, -1 to take the first record
+     **/
+    void open(const QString& path, qint64 videoStart = -1);
+    /** @brief Ends the current log file once its records are written */
+    void close();
+    /** @brief Adds a record to the current log file, never waits for the disk */
+    void append(const TelemetryRecord& record);
+    /** @brief Return the number of records appended to the current log file */
+    quint64 recordCount() const;
+
+    /**
+     * @brief Reads every record of a log file.
+     *
+     * @param path          The path of the log file
+     * @param records       Receives the records
+     * @param videoStart    Receives the capture time of the first frame of the video, can be NULL
+     * @return False if the file can not be read or is not a log
+     **/
+    static bool readRecords(const QString& path, QVector<TelemetryRecord>& records, qint64* videoStart = NULL);
+    /**
+     * @brief Writes the subtitles of a video from its log. When the SeekIndex of the video is
+     * next to the log the subtitles are timed by the frames of the file, which skip the stalls
+     * of the source, otherwise by the capture times.
+     *
+     * @param path      The path of the log file
+     * @param srtPath   The path of the subtitle file
+     * @param interval  Milliseconds between subtitles, 0 for one per frame
+     * @return False if the log can not be read or the subtitles written
+     **/
+    static bool exportSubTitles(const QString& path, const QString& srtPath, int interval = 1000);
+
+protected:
+    /** @brief Writes the gathered records every flushInterval milliseconds */
+    void run();
+
+private:
+    /** @brief Records gathered for a file */
+    struct Batch
+    {
+        QString path;
+        qint64 videoStart;
+        QByteArray data;
+        /** True when the file ends after this batch */
+        bool last;
+    };
+
+    /** @brief Writes the batches to their files, only used by the thread */
+    void writeBatches(const QList<Batch>& batches);
+
+    static const quint16 version = 1;
+    static const int recordSize = 64;
+    static const int headerSize = 16;
+    /** Milliseconds between writes, and records gathered before writing earlier */
+    static const int flushInterval = 500;
+    static const int flushRecords = 256;
+
+    mutable QMutex mutex;
+    QWaitCondition flushCondition;
+    QList<Batch> batches;
+    bool abort;
+    quint64 records;
+
+    /** File being written, only used by the thread */
+    QFile file;
+};
+
+#endif // TELEMETRYLOG_H
@@ -0,0 +1,362 @@
+#include "VideoCaptureThread.h"
+
+#include <QDebug>
+
+const int VideoCaptureThread::maximumBackoff;
+
+VideoCaptureThread::VideoCaptureThread(int heldFrames, QObject* parent)
+    : QThread(parent),
+    pool(initialBuffers, ring.capacity() + qMax(heldFrames, 0) + ownBuffers),
+    scheduler(defaultInterval)
+{
+    lowLatency = true;
+    abort = false;
+    opened = false;
+    liveSource = false;
+    fps = 0.0;
+    sequence = 0;
+    seekFrame = -1;
+    clock.start();
+}
+
+VideoCaptureThread::~VideoCaptureThread()
+{
+    close();
+}
+
+void VideoCaptureThread::open(const QString& url)
+{
+    close();
+
+    this->url = url;
+
+    // Network streams are paced by the sender and are reconnected when lost
+    liveSource = url.contains("://");
+
+    ring.clear();
+    skipped.store(0);
+    sequence = 0;
+    seekFrame = -1;
+
+    start();
+}
+
+bool VideoCaptureThread::stop(unsigned long timeout)
+{
+    {
+        QMutexLocker locker(&mutex);
+        abort = true;
+        wakeCondition.wakeAll();
+    }
+
+    if(!wait(timeout))
+    {
+        return false;
+    }
+
+    ring.clear();
+    pool.clear();
+
+    QMutexLocker locker(&mutex);
+    abort = false;
+    opened = false;
+
+    return true;
+}
+
+void VideoCaptureThread::close()
+{
+    stop(ULONG_MAX);
+}
+
+bool VideoCaptureThread::isOpened() const
+{
+    QMutexLocker locker(&mutex);
+    return opened;
+}
+
+bool VideoCaptureThread::takeFrame(FrameDescriptor& frame)
+{
+    return ring.popLatest(frame);
+}
+
+void VideoCaptureThread::seek(qint64 frame)
+{
+    QMutexLocker locker(&mutex);
+    seekFrame = qMax(frame, (qint64)0);
+}
+
+qint64 VideoCaptureThread::currentTime() const
+{
+    return clock.elapsed();
+}
+
+void VideoCaptureThread::setLowLatency(bool enabled)
+{
+    QMutexLocker locker(&mutex);
+    lowLatency = enabled;
+}
+
+bool VideoCaptureThread::isLowLatency() const
+{
+    QMutexLocker locker(&mutex);
+    return lowLatency;
+}
+
+quint64 VideoCaptureThread::skippedFrames() const
+{
+    return (uint)skipped.load();
+}
+
+QSize VideoCaptureThread::frameSize() const
+{
+    QMutexLocker locker(&mutex);
+    return size;
+}
+
+double VideoCaptureThread::sourceFps() const
+{
+    QMutexLocker locker(&mutex);
+    return fps;
+}
+
+QString VideoCaptureThread::sourceUrl() const
+{
+    return url;
+}
+
+const FrameRing& VideoCaptureThread::frameRing() const
+{
+    return ring;
+}
+
+const FramePool& VideoCaptureThread::framePool() const
+{
+    return pool;
+}
+
+FrameScheduler& VideoCaptureThread::frameScheduler()
+{
+    return scheduler;
+}
+
+void VideoCaptureThread::run()
+{
+    int attempt = 0;
+
+    while(!isAborted())
+    {
+        emit stateChanged(tr("Conectando a %1...").arg(url));
+
+        if(connectSource())
+        {
+            attempt = 0;
+            emit stateChanged(url);
+
+            bool stopped = captureFrames();
+            disconnectSource();
+
+            if(stopped)
+                break;
+
+            if(!liveSource)
+            {
+                qDebug()<<"End of video stream";
+                emit endOfStream();
+                break;
+            }
+
+            emit stateChanged(tr("Conexion perdida con %1").arg(url));
+        }
+        else if(!liveSource)
+        {
+            emit stateChanged(tr("Error al abrir video..."));
+            break;
+        }
+
+        if(!waitToReconnect(attempt++))
+            break;
+    }
+}
+
+bool VideoCaptureThread::connectSource()
+{
+    // May block until the network times out, so it only runs on this thread
+    if(!captureVideo.open(url.toLatin1().data()))
+    {
+        return false;
+    }
+
+    QSize sourceSize(captureVideo.get(CV_CAP_PROP_FRAME_WIDTH), captureVideo.get(CV_CAP_PROP_FRAME_HEIGHT));
+    double sourceFps = captureVideo.get(CV_CAP_PROP_FPS);
+
+    if(sourceFps < minimumFps || sourceFps > maximumFps)
+    {
+        sourceFps = 0.0;
+    }
+
+    pool.reset(cv::Size(sourceSize.width(), sourceSize.height()), CV_8UC3);
+    scheduler.reset(sourceFps);
+
+    QMutexLocker locker(&mutex);
+    size = sourceSize;
+    fps = sourceFps;
+    opened = true;
+
+    return true;
+}
+
+void VideoCaptureThread::disconnectSource()
+{
+    captureVideo.release();
+
+    QMutexLocker locker(&mutex);
+    opened = false;
+}
+
+bool VideoCaptureThread::waitToReconnect(int attempt)
+{
+    int delay = qMin(initialBackoff << qMin(attempt, 16), maximumBackoff);
+
+    emit stateChanged(tr("Reconectando a %1 en %2 s (intento %3)...").arg(url).arg(delay/1000.0, 0, 'f', 1).arg(attempt + 1));
+
+    QMutexLocker locker(&mutex);
+
+    if(!abort)
+    {
+        wakeCondition.wait(&mutex, delay);
+    }
+
+    return !abort;
+}
+
+bool VideoCaptureThread::isAborted() const
+{
+    QMutexLocker locker(&mutex);
+    return abort;
+}
+
+bool VideoCaptureThread::captureFrames()
+{
+    // Offset between the clock and the timestamps of a file
+    qint64 streamOffset = 0;
+    bool synchronized = false;
+    double position = -1.0;
+    int skippedBefore = skipped.load();
+
+    forever
+    {
+        bool drain;
+        qint64 seekTo;
+
+        {
+            QMutexLocker locker(&mutex);
+            if(abort)
+                return true;
+
+            drain = lowLatency && liveSource;
+            seekTo = seekFrame;
+            seekFrame = -1;
+        }
+
+        if(seekTo >= 0 && !liveSource)
+        {
+            // The backend goes to the keyframe before and decodes from there, not from the start
+            if(!captureVideo.set(CV_CAP_PROP_POS_FRAMES, seekTo))
+            {
+                qDebug()<<"Error seeking video to frame"<<seekTo;
+            }
+
+            position = -1.0;
+            synchronized = false;
+        }
+
+        cv::Mat decoded;
+        FrameDescriptor frame;
+
+        if(!(drain ? grabNewest() : captureVideo.grab()))
+            return false;
+
+        frame.captureTime = clock.elapsed();
+
+        if(!captureVideo.retrieve(decoded))
+            return false;
+
+        // The decoded image may wrap the decoder's own buffer, which the next read overwrites
+        frame.image = pool.acquire();
+        decoded.copyTo(frame.image);
+
+        // Numbered across reconnections, skipped frames leave gaps
+        sequence += skipped.load() - skippedBefore + 1;
+        skippedBefore = skipped.load();
+        frame.sequence = sequence;
+
+        double lastPosition = position;
+        position = captureVideo.get(CV_CAP_PROP_POS_MSEC);
+
+        // Network streams are paced by the sender, only their arrival matters
+        if(liveSource)
+        {
+            frame.streamPosition = position > 0.0 ? position : -1.0;
+            frame.markStage(FrameDescriptor::Captured, clock.elapsed());
+
+            ring.push(frame);
+            emit frameCaptured();
+
+            scheduler.sourceFrame(frame.captureTime);
+            continue;
+        }
+
+        // Files are paced by their own timestamps, estimated when the backend gives none
+        if(position <= lastPosition)
+        {
+            double period = scheduler.sourcePeriod();
+            position = lastPosition + (period > 0.0 ? period : defaultInterval);
+        }
+
+        frame.streamPosition = position;
+        frame.markStage(FrameDescriptor::Captured, clock.elapsed());
+
+        ring.push(frame);
+        emit frameCaptured();
+
+        scheduler.sourceFrame(qRound64(position));
+
+        qint64 wait = qRound64(position) + streamOffset - clock.elapsed();
+
+        if(!synchronized || qAbs(wait) > maximumDrift)
+        {
+            // First frame, seek or too far behind, do not try to catch up
+            streamOffset = clock.elapsed() - qRound64(position);
+            synchronized = true;
+            wait = 0;
+        }
+
+        if(wait > 0)
+        {
+            msleep(wait);
+        }
+    }
+}
+
+bool VideoCaptureThread::grabNewest()
+{
+    QElapsedTimer grabClock;
+
+    // Buffered frames only cost their decoding, waiting for the network takes most of a period
+    double period = fps > 0.0 ? 1000.0/fps : defaultInterval;
+    qint64 threshold = qMax((qint64)backlogThreshold, qRound64(period/2.0));
+
+    for(int count = 0; ; count++)
+    {
+        grabClock.start();
+
+        if(!captureVideo.grab())
+            return false;
+
+        if(grabClock.elapsed() >= threshold || count == maximumSkipped)
+            return true;
+
+        skipped.fetchAndAddRelaxed(1);
+    }
+}
@@ -0,0 +1,173 @@
+#ifndef VIDEOCAPTURETHREAD_H
+#define VIDEOCAPTURETHREAD_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSize>
+#include <QString>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "FrameRing.h"
+#include "FramePool.h"
+#include "FrameScheduler.h"
+
+/** @brief Owns the video source and decodes it on its own thread at the native rate of the stream. Files are paced by their timestamps. */
+class VideoCaptureThread : public QThread
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief This is the class constructor.
+     *
+     * @param  heldFrames   Frames the consumers may keep at once besides the queue, the recycled
+     *                      buffers cover them so they are not allocated for each frame
+     * @param  parent       Parent object
+    **/
+    VideoCaptureThread(int heldFrames = 0, QObject* parent = NULL);
+    ~VideoCaptureThread();
+
+    /**
+     * @brief Starts opening and decoding a video source in the background. Network streams are
+     * reconnected with an exponential backoff when they can not be opened or are lost. Files
+     * are not, their errors and their end are only reported, so they do not go through the
+     * reconnection. The progress is reported through stateChanged().
+     *
+     * @param url The URL or file path of the video
+     **/
+    void open(const QString& url);
+    /**
+     * @brief Asks the capture to stop and waits for it.
+     *
+     * @param timeout Time in milliseconds to wait, a read blocked on the network may outlast it
+     * @return True if the capture stopped, otherwise it stops by itself once the read returns
+     **/
+    bool stop(unsigned long timeout);
+    /** @brief Stops the capture, waiting as long as needed */
+    void close();
+    /** @brief Return true while the video source is opened and decoding */
+    bool isOpened() const;
+    /**
+     * @brief Takes the most recent decoded frame, older queued frames are dropped.
+     *
+     * @param frame Receives the frame with its capture time, sequence number and stream position,
+     *              the pixel data is shared not copied
+     * @return True if a frame not taken before was available
+     **/
+    bool takeFrame(FrameDescriptor& frame);
+    /**
+     * @brief Moves a file to a frame before the next one is decoded. Network streams can not seek.
+     *
+     * @param frame Number of the frame, from 0
+     **/
+    void seek(qint64 frame);
+    /** @brief Return the size of the frames of the opened source */
+    QSize frameSize() const;
+    /** @brief Return the frame rate reported by the opened source */
+    double sourceFps() const;
+    /** @brief Return the URL given to open() */
+    QString sourceUrl() const;
+    /** @brief Return the queue of decoded frames, used to query its counters */
+    const FrameRing& frameRing() const;
+    /** @brief Return the buffers recycled for decoded frames, used to query its counters */
+    const FramePool& framePool() const;
+    /** @brief Return the scheduler that estimates the rate of the source and paces the display */
+    FrameScheduler& frameScheduler();
+    /** @brief Return the time in milliseconds of the monotonic clock used to stamp the frames */
+    qint64 currentTime() const;
+    /**
+     * @brief Enables the low latency mode for network streams. The frames buffered by the
+     * decoder are grabbed and skipped, and only the newest one is retrieved.
+     *
+     * @param enabled Enable low latency
+     **/
+    void setLowLatency(bool enabled);
+    /** @brief Return true if the low latency mode is enabled */
+    bool isLowLatency() const;
+    /** @brief Return the number of buffered frames skipped by the low latency mode */
+    quint64 skippedFrames() const;
+
+signals:
+    /** @brief Emit when a new frame is available through takeFrame() */
+    void frameCaptured();
+    /** @brief Emit when a file can not provide more frames */
+    void endOfStream();
+    /** @brief Emit the progress of opening and reconnecting the source */
+    void stateChanged(QString message);
+
+protected:
+    /** @brief Capture loop, runs until close() is called or the stream ends */
+    void run();
+    /**
+     * @brief Opens the source, may block until the network times out. This and the next two
+     * are virtual so a subclass can fail the source on purpose and drive the reconnection.
+     **/
+    virtual bool connectSource();
+    /** @brief Releases the source */
+    virtual void disconnectSource();
+    /**
+     * @brief Decodes frames until the stream fails or the capture is stopped.
+     *
+     * @return True if the capture was stopped, false if the stream failed
+     **/
+    virtual bool captureFrames();
+    /**
+     * @brief Grabs frames until one was not already buffered by the decoder.
+     *
+     * @return False if the stream ended
+     **/
+    bool grabNewest();
+    /**
+     * @brief Waits before the next attempt to open the source.
+     *
+     * @param attempt Number of failed attempts, doubles the wait each time
+     * @return False if the capture was stopped meanwhile
+     **/
+    bool waitToReconnect(int attempt);
+    /** @brief Return true if the capture was asked to stop */
+    bool isAborted() const;
+
+private:
+    /** @brief Minimum and maximum accepted frame rates reported by sources */
+    static const int minimumFps = 1;
+    static const int maximumFps = 120;
+    /** @brief Frame interval in milliseconds used while the rate of the source is unknown */
+    static const int defaultInterval = 40;
+    /** @brief Largest difference in milliseconds between a file and the clock before resynchronizing */
+    static const int maximumDrift = 1000;
+    /** @brief Grabs faster than half a source period, and at least this many milliseconds, are taken as buffered frames */
+    static const int backlogThreshold = 4;
+    /** @brief Maximum number of buffered frames skipped before a retrieve */
+    static const int maximumSkipped = 60;
+    /** @brief First and longest wait in milliseconds between attempts to open a network stream */
+    static const int initialBackoff = 500;
+    static const int maximumBackoff = 30000;
+    /** @brief Buffers preallocated for the frames, and the ones in use besides the consumers: decoded and displayed */
+    static const int initialBuffers = 8;
+    static const int ownBuffers = 2;
+
+    cv::VideoCapture captureVideo;
+    QString url;
+    mutable QMutex mutex;
+    QWaitCondition wakeCondition;
+    FrameRing ring;
+    FramePool pool;
+    FrameScheduler scheduler;
+    QElapsedTimer clock;
+    QAtomicInt skipped;
+    quint64 sequence;
+    /** Frame to seek to before the next decode, -1 for none */
+    qint64 seekFrame;
+    bool lowLatency;
+    bool abort;
+    bool opened;
+    bool liveSource;
+    QSize size;
+    double fps;
+};
+
+#endif // VIDEOCAPTURETHREAD_H
@@ -0,0 +1,47 @@
+#include "VideoGridWidget.h"
+
+#include <qmath.h>
+
+VideoGridWidget::VideoGridWidget(int streams, QWidget *parent) :
+        QWidget(parent)
+{
+    pool = new StreamWorkerPool(0, this);
+
+    QGridLayout* glVideos = new QGridLayout();
+    int columns = qCeil(qSqrt(qMax(streams, 1)));
+
+    for(int i = 0; i < streams; i++)
+    {
+        OpenCVWidget* video = new OpenCVWidget(this);
+        video->setWorkerPool(pool);
+
+        glVideos->addWidget(video, i/columns, i%columns);
+        videos.append(video);
+    }
+
+    glVideos->setContentsMargins(2, 2, 2, 2);
+    setLayout(glVideos);
+
+    setWindowTitle("VIDEOS");
+}
+
+VideoGridWidget::~VideoGridWidget()
+{
+    // The videos stop their jobs before the workers are destroyed
+    qDeleteAll(videos);
+}
+
+OpenCVWidget* VideoGridWidget::videoAt(int index) const
+{
+    return videos.value(index);
+}
+
+int VideoGridWidget::videoCount() const
+{
+    return videos.size();
+}
+
+StreamWorkerPool* VideoGridWidget::workerPool() const
+{
+    return pool;
+}
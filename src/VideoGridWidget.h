@@ -0,0 +1,38 @@
+#ifndef VIDEOGRIDWIDGET_H
+#define VIDEOGRIDWIDGET_H
+
+#include <QWidget>
+#include <QGridLayout>
+#include <QList>
+
+#include "OpenCVWidget.h"
+#include "StreamWorkerPool.h"
+
+/** @brief Shows several videos in a grid, their frames are processed by the same worker threads. */
+class VideoGridWidget : public QWidget
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief This is the class constructor.
+     *
+     * @param  streams  Number of videos shown
+     * @param  parent   Parent the grid widget
+    **/
+    explicit VideoGridWidget(int streams = 4, QWidget *parent = 0);
+    ~VideoGridWidget();
+
+    /** @brief Return the video widget at a position of the grid */
+    OpenCVWidget* videoAt(int index) const;
+    /** @brief Return the number of videos shown */
+    int videoCount() const;
+    /** @brief Return the worker threads shared by the videos */
+    StreamWorkerPool* workerPool() const;
+
+private:
+    StreamWorkerPool* pool;
+    QList<OpenCVWidget*> videos;
+};
+
+#endif // VIDEOGRIDWIDGET_H
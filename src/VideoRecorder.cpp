@@ -0,0 +1,392 @@
+#include "VideoRecorder.h"
+
+#include <QFileInfo>
+#include <QDebug>
+
+const int VideoRecorder::backlogQuality;
+
+VideoRecorder::VideoRecorder(int capacity, QObject* parent)
+    : QThread(parent),
+    queueCapacity(qMax(capacity, 1))
+{
+    fps = 0.0;
+    policy = Degrade;
+    blockTimeout = 20;
+    recording = false;
+    closing = false;
+    startTime = 0;
+    writtenFrames = 0;
+    fileFrames = 0;
+    sizeCheckTime = 0;
+    offered = 0;
+    encoded = 0;
+    repeated = 0;
+    dropped = 0;
+    skipped = 0;
+}
+
+VideoRecorder::~VideoRecorder()
+{
+    close();
+    wait();
+}
+
+bool VideoRecorder::open(const QString& path, double fps, const cv::Size& size, const QList<CompressedFrame>& preEvent)
+{
+    if(isRunning())
+    {
+        qDebug()<<"Recorder still encoding the previous recording";
+        return false;
+    }
+
+    segments.start(path, ".avi");
+
+    QMutexLocker locker(&mutex);
+    this->fps = fps;
+    this->size = size;
+    preEventFrames.clear();
+
+    for(int i = 0; i < preEvent.size(); i++)
+    {
+        QueuedFrame queued;
+        queued.frame = preEvent[i].descriptor;
+        queued.data = preEvent[i].data;
+        preEventFrames.append(queued);
+    }
+
+    recording = true;
+    closing = false;
+    offered = 0;
+    encoded = 0;
+    repeated = 0;
+    dropped = 0;
+    skipped = 0;
+
+    // The encoder must not take the time of the display
+    start(QThread::LowPriority);
+
+    return true;
+}
+
+RecordingSegments& VideoRecorder::recordingSegments()
+{
+    return segments;
+}
+
+void VideoRecorder::close()
+{
+    QMutexLocker locker(&mutex);
+    recording = false;
+    closing = true;
+    notEmpty.wakeAll();
+    notFull.wakeAll();
+}
+
+bool VideoRecorder::isRecording() const
+{
+    QMutexLocker locker(&mutex);
+    return recording;
+}
+
+bool VideoRecorder::write(const FrameDescriptor& frame, const TelemetryRecord& telemetry)
+{
+    QMutexLocker locker(&mutex);
+
+    if(!recording)
+    {
+        return false;
+    }
+
+    offered++;
+
+    if(policy == Degrade && queue.size() >= queueCapacity/2)
+    {
+        // Evenly spaced frames look better than bursts of drops when the queue fills
+        uint step = queue.size() >= 3*queueCapacity/4 ? 4 : 2;
+
+        if(offered % step != 0)
+        {
+            dropped++;
+            return false;
+        }
+    }
+    else if(policy == Block && queue.size() >= queueCapacity)
+    {
+        // Bounded, so a stalled disk never freezes the display
+        notFull.wait(&mutex, blockTimeout);
+    }
+
+    if(queue.size() >= queueCapacity || !recording)
+    {
+        dropped++;
+        return false;
+    }
+
+    QueuedFrame queued;
+    queued.frame = frame;
+    queued.telemetry = telemetry;
+    queued.hasTelemetry = true;
+    queue.enqueue(queued);
+    notEmpty.wakeOne();
+
+    return true;
+}
+
+void VideoRecorder::setBackpressure(Backpressure policy)
+{
+    QMutexLocker locker(&mutex);
+    this->policy = policy;
+}
+
+VideoRecorder::Backpressure VideoRecorder::backpressure() const
+{
+    QMutexLocker locker(&mutex);
+    return policy;
+}
+
+void VideoRecorder::setBlockTimeout(int timeout)
+{
+    QMutexLocker locker(&mutex);
+    blockTimeout = qMax(timeout, 0);
+}
+
+int VideoRecorder::queueDepth() const
+{
+    QMutexLocker locker(&mutex);
+    return queue.size();
+}
+
+int VideoRecorder::capacity() const
+{
+    return queueCapacity;
+}
+
+quint64 VideoRecorder::encodedFrames() const
+{
+    QMutexLocker locker(&mutex);
+    return encoded;
+}
+
+quint64 VideoRecorder::repeatedFrames() const
+{
+    QMutexLocker locker(&mutex);
+    return repeated;
+}
+
+quint64 VideoRecorder::droppedFrames() const
+{
+    QMutexLocker locker(&mutex);
+    return dropped;
+}
+
+quint64 VideoRecorder::skippedFrames() const
+{
+    QMutexLocker locker(&mutex);
+    return skipped;
+}
+
+void VideoRecorder::run()
+{
+    if(!openSegment())
+    {
+        QMutexLocker locker(&mutex);
+        recording = false;
+        queue.clear();
+        notFull.wakeAll();
+        return;
+    }
+
+    // Frames beyond it are dropped while the ones from before the recording are encoded
+    const int backlogLimit = 4*preEventFrames.size() + queueCapacity;
+
+    forever
+    {
+        QueuedFrame queued;
+        bool taken = false;
+
+        {
+            QMutexLocker locker(&mutex);
+
+            while(queue.isEmpty() && !closing && preEventFrames.isEmpty())
+            {
+                notEmpty.wait(&mutex);
+            }
+
+            // Closed and every queued frame encoded
+            if(queue.isEmpty() && preEventFrames.isEmpty())
+                break;
+
+            if(!queue.isEmpty())
+            {
+                queued = queue.dequeue();
+                taken = true;
+                notFull.wakeOne();
+            }
+        }
+
+        bool encoding = true;
+
+        if(preEventFrames.isEmpty())
+        {
+            encoding = encode(queued);
+        }
+        else if(!taken)
+        {
+            encoding = encodePreEvent();
+        }
+        else if(preEventFrames.size() < backlogLimit)
+        {
+            // Older frames are still being encoded, it waits compressed behind them so the
+            // queue keeps room and the live frames are not dropped or blocked meanwhile
+            std::vector<int> parameters;
+            parameters.push_back(CV_IMWRITE_JPEG_QUALITY);
+            parameters.push_back(backlogQuality);
+
+            if(cv::imencode(".jpg", queued.frame.image, queued.data, parameters))
+            {
+                queued.frame.image = cv::Mat();
+                preEventFrames.append(queued);
+            }
+        }
+        else
+        {
+            QMutexLocker locker(&mutex);
+            dropped++;
+        }
+
+        if(!encoding)
+        {
+            // No file to write to, the frames left are discarded and the writers no longer wait for room
+            QMutexLocker locker(&mutex);
+            recording = false;
+            dropped += queue.size() + preEventFrames.size();
+            queue.clear();
+            preEventFrames.clear();
+            notFull.wakeAll();
+            break;
+        }
+    }
+
+    writer.release();
+    index.close();
+    telemetry.close();
+    segments.enforceRetention();
+}
+
+bool VideoRecorder::encodePreEvent()
+{
+    QueuedFrame queued = preEventFrames.takeFirst();
+
+    queued.frame.image = cv::imdecode(queued.data, CV_LOAD_IMAGE_COLOR);
+    queued.data.clear();
+
+    // Kept before the source changed its size
+    if(queued.frame.image.cols != size.width || queued.frame.image.rows != size.height)
+        return true;
+
+    return encode(queued);
+}
+
+bool VideoRecorder::openSegment()
+{
+    QString file = segments.segmentFile();
+
+    if(!writer.open(file.toLatin1().data(), CV_FOURCC('D','I','V','X'), fps, size, true))
+    {
+        qDebug()<<"Error opening video writer"<<file;
+        emit error(tr("Error al grabar video %1").arg(file));
+        return false;
+    }
+
+    // Playback seeks without it, only slower
+    index.create(segments.segmentPath() + SeekIndex::fileExtension(), fps);
+
+    startTime = -1;
+    writtenFrames = 0;
+    fileFrames = 0;
+    emit segmentStarted(segments.segmentPath());
+
+    return true;
+}
+
+bool VideoRecorder::encode(const QueuedFrame& queued)
+{
+    const FrameDescriptor& frame = queued.frame;
+
+    if(startTime >= 0)
+    {
+        qint64 segmentSize = 0;
+
+        // The file is only measured once a second
+        if(frame.captureTime - sizeCheckTime >= 1000)
+        {
+            segmentSize = QFileInfo(segments.segmentFile()).size();
+            sizeCheckTime = frame.captureTime;
+        }
+
+        if(segments.isFull(frame.captureTime - startTime, segmentSize))
+        {
+            // Finalizing and opening files here keeps them off the display
+            writer.release();
+            index.close();
+            telemetry.close();
+            segments.enforceRetention();
+            segments.nextSegment();
+
+            if(!openSegment())
+            {
+                QMutexLocker locker(&mutex);
+                dropped++;
+                return false;
+            }
+        }
+    }
+
+    if(startTime < 0)
+    {
+        startTime = frame.captureTime;
+        sizeCheckTime = frame.captureTime;
+
+        // The subtitles of the file count from its first frame
+        telemetry.open(segments.segmentPath() + TelemetryLog::fileExtension(), startTime);
+    }
+
+    if(queued.hasTelemetry)
+    {
+        telemetry.append(queued.telemetry);
+    }
+
+    qint64 due = qRound64((frame.captureTime - startTime)*fps/1000.0) + 1;
+
+    if(due - writtenFrames > maximumGap*fps)
+    {
+        // The source stalled, do not fill the whole gap
+        writtenFrames = due - 1;
+    }
+
+    if(due <= writtenFrames)
+    {
+        // Faster than the rate of the video
+        QMutexLocker locker(&mutex);
+        skipped++;
+        return true;
+    }
+
+    qint64 count = due - writtenFrames;
+
+    // The timeline skips stalls, the file does not
+    index.append(fileFrames, frame.captureTime, frame.sequence);
+
+    while(writtenFrames < due)
+    {
+        writer << frame.image;
+        writtenFrames++;
+        fileFrames++;
+    }
+
+    QMutexLocker locker(&mutex);
+    encoded++;
+    repeated += count - 1;
+
+    return true;
+}
@@ -0,0 +1,171 @@
+#ifndef VIDEORECORDER_H
+#define VIDEORECORDER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QString>
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/highgui/highgui.hpp"
+
+#include "FrameDescriptor.h"
+#include "RecordingSegments.h"
+#include "PreEventBuffer.h"
+#include "SeekIndex.h"
+#include "TelemetryLog.h"
+
+/**
+ * @brief Encodes a recording on its own thread, fed through a bounded queue.
+ *
+ * The container has a fixed rate, so frames missing since the last one written are
+ * filled by repeating the next one and the video keeps the timing of the capture.
+ * The frames from before the recording are encoded one at a time between taking the live
+ * ones, which wait compressed behind them, so the queue does not fill meanwhile.
+ * A SeekIndex next to each file maps the captured frames to the frames of the file, and a
+ * TelemetryLog next to it keeps the telemetry given with the frames of that file.
+**/
+class VideoRecorder : public QThread
+{
+    Q_OBJECT
+public:
+    /** @brief What write() does when the encoder falls behind */
+    enum Backpressure
+    {
+        /** Waits for room in the queue, at most the block timeout, then drops */
+        Block = 0,
+        /** Drops the frame when the queue is full */
+        Drop,
+        /** Records one of every two or four frames once the queue passes half full */
+        Degrade
+    };
+
+    /**
+     * @brief This is the class constructor.
+     *
+     * @param  capacity Maximum number of frames waiting to be encoded
+     * @param  parent   Parent object
+    **/
+    VideoRecorder(int capacity = 32, QObject* parent = NULL);
+    ~VideoRecorder();
+
+    /**
+     * @brief Starts a recording. Refused while the previous one is still encoding, see isRunning(),
+     * a new recorder is used instead so the caller never waits for it.
+     *
+     * @param path      The path of the video without extension, segments add a number to it
+     * @param fps       Frame rate of the video
+     * @param size      Size of the frames
+     * @param preEvent  Frames from before the recording was started, encoded first
+     * @return False if the previous recording is still running
+     **/
+    bool open(const QString& path, double fps, const cv::Size& size, const QList<CompressedFrame>& preEvent = QList<CompressedFrame>());
+    /** @brief Return the limits of the segments of the recordings and of the disk they use */
+    RecordingSegments& recordingSegments();
+    /** @brief Ends the recording once the queued frames are encoded, without waiting for them */
+    void close();
+    /** @brief Return true while frames are accepted */
+    bool isRecording() const;
+    /**
+     * @brief Queues a frame to be encoded.
+     *
+     * @param frame     The frame, its pixels must not be modified afterwards
+     * @param telemetry The telemetry when the frame was recorded, logged with the segment the frame goes to
+     * @return False if the frame was dropped
+     **/
+    bool write(const FrameDescriptor& frame, const TelemetryRecord& telemetry);
+
+    /** @brief Sets what write() does when the encoder falls behind */
+    void setBackpressure(Backpressure policy);
+    /** @brief Return what write() does when the encoder falls behind */
+    Backpressure backpressure() const;
+    /** @brief Sets the longest time in milliseconds the Block policy waits */
+    void setBlockTimeout(int timeout);
+
+    /** @brief Return the number of frames waiting to be encoded */
+    int queueDepth() const;
+    /** @brief Return the maximum number of frames waiting to be encoded */
+    int capacity() const;
+    /** @brief Return the number of frames encoded since open() */
+    quint64 encodedFrames() const;
+    /** @brief Return the number of frames encoded again to keep the timing since open() */
+    quint64 repeatedFrames() const;
+    /** @brief Return the number of frames dropped by the backpressure since open() */
+    quint64 droppedFrames() const;
+    /** @brief Return the number of frames not encoded because they came faster than the rate of the video since open() */
+    quint64 skippedFrames() const;
+
+signals:
+    /** @brief Emit when the video file can not be written */
+    void error(QString message);
+    /** @brief Emit when a segment of the recording starts, with its path without extension */
+    void segmentStarted(QString path);
+
+protected:
+    /** @brief A frame waiting to be encoded */
+    struct QueuedFrame
+    {
+        QueuedFrame() : hasTelemetry(false) {}
+
+        FrameDescriptor frame;
+        /** The frame as JPEG while it waits behind older frames, its pixels are then released */
+        std::vector<uchar> data;
+        /** Telemetry when the frame was recorded, the frames from before the recording have none */
+        TelemetryRecord telemetry;
+        bool hasTelemetry;
+    };
+
+    /** @brief Encoding loop, runs until the queue is drained after close() */
+    void run();
+    /** @brief Encodes a frame, repeating it to fill the frames missing since the last one. Return false if the next segment could not be opened */
+    bool encode(const QueuedFrame& queued);
+    /** @brief Opens the file of the current segment */
+    bool openSegment();
+    /** @brief Decodes and encodes the oldest frame waiting compressed, return false as encode() */
+    bool encodePreEvent();
+
+private:
+    /** @brief Longest gap in seconds filled with repeated frames */
+    static const int maximumGap = 2;
+    /** @brief JPEG quality of the live frames waiting behind the ones from before the recording */
+    static const int backlogQuality = 90;
+
+    cv::VideoWriter writer;
+    /** Written next to each segment, only used by the thread */
+    SeekIndex index;
+    TelemetryLog telemetry;
+    RecordingSegments segments;
+    double fps;
+    cv::Size size;
+    /** Frames from before the recording, then the live frames taken while they are encoded, only
+        used by the thread once started */
+    QList<QueuedFrame> preEventFrames;
+
+    mutable QMutex mutex;
+    QWaitCondition notEmpty;
+    QWaitCondition notFull;
+    QQueue<QueuedFrame> queue;
+    const int queueCapacity;
+    Backpressure policy;
+    int blockTimeout;
+    bool recording;
+    bool closing;
+
+    /** Capture time of the first frame of the segment and frames of its timeline covered since, a
+        stall skips ahead without writing, only used by the thread */
+    qint64 startTime;
+    qint64 writtenFrames;
+    /** Frames actually in the file of the segment, the frame numbers of the index */
+    qint64 fileFrames;
+    /** Capture time when the size of the segment was last checked */
+    qint64 sizeCheckTime;
+
+    quint64 offered;
+    quint64 encoded;
+    quint64 repeated;
+    quint64 dropped;
+    quint64 skipped;
+};
+
+#endif // VIDEORECORDER_H
@@ -1,10 +1,25 @@
 #include <QApplication>
 //#include "mainwindow.h"
 #include "OpenCVWidget.h"
+#include "VideoGridWidget.h"
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+
+    // --streams N shows N videos in a grid sharing the processing threads
+    QStringList arguments = a.arguments();
+    int index = arguments.indexOf("--streams");
+    int streams = index >= 0 ? arguments.value(index + 1).toInt() : 1;
+
+    if(streams > 1)
+    {
+        VideoGridWidget grid(streams);
+        grid.show();
+
+        return a.exec();
+    }
+
     OpenCVWidget w;
     w.show();
 
@@ -1,4 +1,5 @@
 #include "videoStabilizer.h"
+#include "GrayCodeKernels.h"
 #include <QDebug>
 #include <iostream>
 #include <QTimer>
@@ -6,14 +7,45 @@
 #include <unistd.h>
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/core/types_c.h"
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
 
+/** @brief Threads shared by the stabilizers of every video to search the subframes */
+static QThreadPool* subframeWorkers()
+{
+    static QThreadPool workers;
+    return &workers;
+}
+
+/** @brief Searches the motion of a subframe on the subframe workers */
+class SubframeJob : public QRunnable
+{
+public:
+    SubframeJob(videoStabilizer* stabilizer, uchar subframe, uchar t_m1, QSemaphore* finished)
+        : stabilizer(stabilizer),
+        subframe(subframe),
+        t_m1(t_m1),
+        finished(finished)
+    {
+    }
+
+    void run()
+    {
+        stabilizer->processSubframe(subframe, t_m1);
+        finished->release();
+    }
+
+private:
+    videoStabilizer* stabilizer;
+    uchar subframe;
+    uchar t_m1;
+    QSemaphore* finished;
+};
 
 videoStabilizer::videoStabilizer(QRect videoSize, QObject *parent):
         QObject(parent),
-        currentGrayCodeIndex(0),
-        searchFactorWindow(SEARCH_FACTOR_P/2),
-        vSearchOffset(videoSize.height()/2),
-        hSearchOffset(videoSize.width()/2)
+        currentGrayCodeIndex(0)
         //    #if USE_OPENCV
         //    duration(0.0),
         //    averageTime(0.0),
@@ -37,43 +69,25 @@ videoStabilizer::videoStabilizer(QRect videoSize, QObject *parent):
     videoHeight = videoSize.height();
     videoWidth  = videoSize.width();
 
-    allocateAndInitialize();
-
-    computeSearchWindows();
-
-#if DO_FULL_CORRELATION
-    for (uchar subframe = 0; subframe < 4; subframe++) {
-        for (int m = 0; m < 2*SEARCH_FACTOR_P+1; m++ ){
-            for (int n = 0; n < 2*SEARCH_FACTOR_P+1; n++){
-                fullCorrelationMatrix[subframe][n][m].m = m -SEARCH_FACTOR_P;
-                fullCorrelationMatrix[subframe][n][m].n = n -SEARCH_FACTOR_P;
-                fullCorrelationMatrix[subframe][n][m].value = 0;
-            }
-        }
-    }
-
-#else
-
-    for (uint subframe = 0; subframe < 4; subframe++){
-
-        computeCorrelationLocations( subframe,
-                                     subframeLocations[subframe].lx - searchFactorWindow,
-                                     subframeLocations[subframe].ly - searchFactorWindow,
-                                     0,
-                                     searchFactorWindow,
-                                     searchFactorWindow);
-    }
-
-#endif
+    requestedColumns = 0;
+    requestedRows = 0;
+    geometryChanged = true;
+    applyGeometry();
 
+    strategy = FullSearch;
+    evaluation = false;
+    earlyTermination = true;
+    parallelSubframes = true;
+    activeStrategy = FullSearch;
+    evaluating = false;
+    terminating = true;
+    resetSearchStatistics();
 
 }
 
 videoStabilizer::~videoStabilizer(){
 #if USE_OPENCV
     imageMatrix.release();
-    grayCodeMatrix[0].release();
-    grayCodeMatrix[1].release();
 
 #else
     for (int ii = 0; ii < videoHeight; ii++){
@@ -83,84 +97,248 @@ videoStabilizer::~videoStabilizer(){
 }
 
 void videoStabilizer::allocateAndInitialize(){
-    // Initialize each subframe correlation vectors
-    for (uint subframe = 0; subframe < 4; subframe++) {
-        memset(correlationMatrix[subframe],0, sizeof(tcorrMatElement)*18);
+    const int side = 2*searchFactor+1;
+
+    for (uint subframe = 0; subframe < subframes; subframe++) {
+        fullCorrelationMatrix[subframe].resize(side*side);
+        partialOffsets[subframe].assign(side*side, 0);
+        visitedOffsets[subframe].assign(side*side, 0);
+
+        for (int m = 0; m < side; m++ ){
+            for (int n = 0; n < side; n++){
+                fullCorrelationMatrix[subframe][n*side + m].m = m -searchFactor;
+                fullCorrelationMatrix[subframe][n*side + m].n = n -searchFactor;
+                fullCorrelationMatrix[subframe][n*side + m].value = 0;
+            }
+        }
     }
 
+    // Initialize each subframe results
+    memset(strategyMinima, 0, sizeof(strategyMinima));
+    memset(strategyCounters, 0, sizeof(strategyCounters));
+
 #if USE_OPENCV
-    /// allocate the memory of all the Matrices
-    grayCodeMatrix[0] = cv::Mat::zeros(videoHeight, videoWidth, CV_8UC1);
-    grayCodeMatrix[1] = cv::Mat::zeros(videoHeight, videoWidth, CV_8UC1);
+    /// allocate the memory of all the Matrices, only the search area of each subframe
+    grayCodeStride = (grayCodeWidth() + 63)/64 + 1;
+    for (uint subframe = 0; subframe < subframes; subframe++) {
+        grayCodeMatrix[0][subframe].assign(GRAY_CODE_PLANES*grayCodeHeight()*grayCodeStride, 0);
+        grayCodeMatrix[1][subframe].assign(GRAY_CODE_PLANES*grayCodeHeight()*grayCodeStride, 0);
+    }
 
     //imageMatrix = cv::Mat(videoHeight, videoWidth, CV_8UC1);
 
 #else
     /// allocate the memory of all the Matrices
-    grayCodeMatrix[0].resize(videoHeight);
-    grayCodeMatrix[1].resize(videoHeight);
+    for (uint subframe = 0; subframe < subframes; subframe++) {
+        grayCodeMatrix[0][subframe].resize(GRAY_CODE_PLANES*grayCodeHeight());
+        grayCodeMatrix[1][subframe].resize(GRAY_CODE_PLANES*grayCodeHeight());
+
+        for (uint ii = 0; ii < GRAY_CODE_PLANES*grayCodeHeight(); ii++){
+            grayCodeMatrix[0][subframe][ii].resize(grayCodeWidth());
+            grayCodeMatrix[1][subframe][ii].resize(grayCodeWidth());
+        }
+    }
 
     imageMatrix.resize(videoHeight);
 
     for (int ii = 0; ii < videoHeight; ii++){
-        grayCodeMatrix[0][ii].resize(videoWidth);
-        grayCodeMatrix[1][ii].resize(videoWidth);
         imageMatrix[ii] = new uchar[videoWidth];
     }
 
 #endif
 
+    for (uint subframe = 0; subframe < subframes; subframe++) {
+        subframePlane[subframe] = 4 - GRAY_CODE_FIRST_PLANE;
+    }
+
     // Clear the motion vectors
     memset(&vg_tm1, 0, sizeof(tcorrMatElement));
     memset(&va_tm1, 0, sizeof(tcorrMatElement));
     memset(&va, 0, sizeof(tcorrMatElement));
 }
 
+uint videoStabilizer::grayCodeWidth () const{
+    return subframeLocations[0].rx - subframeLocations[0].lx + 2*searchFactor;
+}
+
+uint videoStabilizer::grayCodeHeight () const{
+    return subframeLocations[0].ry - subframeLocations[0].ly + 2*searchFactor;
+}
+
 void videoStabilizer::computeSearchWindows (){
-    /// Compute the search windows
-    // UL
-    subframeLocations[0].lx = hSearchOffset/2 - HORIZ_WINDOW_M/2;
-    subframeLocations[0].rx = hSearchOffset/2 + HORIZ_WINDOW_M/2;
-    subframeLocations[0].ly = vSearchOffset/2 - VERT_WINDOW_N/2;
-    subframeLocations[0].ry = vSearchOffset/2 + VERT_WINDOW_N/2;
-    // UR
-    subframeLocations[1].lx = hSearchOffset/2 - HORIZ_WINDOW_M/2 + hSearchOffset;
-    subframeLocations[1].rx = hSearchOffset/2 + HORIZ_WINDOW_M/2 + hSearchOffset;
-    subframeLocations[1].ly = vSearchOffset/2 - VERT_WINDOW_N/2;
-    subframeLocations[1].ry = vSearchOffset/2 + VERT_WINDOW_N/2;
-    // LL
-    subframeLocations[2].lx = hSearchOffset/2 - HORIZ_WINDOW_M/2;
-    subframeLocations[2].rx = hSearchOffset/2 + HORIZ_WINDOW_M/2;
-    subframeLocations[2].ly = vSearchOffset/2 - VERT_WINDOW_N/2 + vSearchOffset;
-    subframeLocations[2].ry = vSearchOffset/2 + VERT_WINDOW_N/2 + vSearchOffset;
-    // LR
-    subframeLocations[3].lx = hSearchOffset/2 - HORIZ_WINDOW_M/2 + hSearchOffset;
-    subframeLocations[3].rx = hSearchOffset/2 + HORIZ_WINDOW_M/2 + hSearchOffset;
-    subframeLocations[3].ly = vSearchOffset/2 - VERT_WINDOW_N/2 + vSearchOffset;
-    subframeLocations[3].ry = vSearchOffset/2 + VERT_WINDOW_N/2 + vSearchOffset;
+    /// Compute the search windows, one at the center of each cell
+    const int cellWidth = videoWidth/(int)gridColumns;
+    const int cellHeight = videoHeight/(int)gridRows;
+
+    // Larger frames get larger windows, as wide as the words of a match row allow
+    int halfWidth = LMIN(32*MAX_WINDOW_WORDS, LMAX((int)windowWidth, cellWidth/WINDOW_CELL_DIVISOR)/2);
+    int halfHeight = LMAX((int)windowHeight, cellHeight/WINDOW_CELL_DIVISOR)/2;
+
+    // The window and its search area must fit inside the frame, signed so small frames do not wrap
+    halfWidth = LMAX(1, LMIN(halfWidth, (videoWidth - 1)/2 - searchFactor));
+    halfHeight = LMAX(1, LMIN(halfHeight, (videoHeight - 1)/2 - searchFactor));
+
+    for (int row = 0; row < (int)gridRows; row++) {
+        for (int column = 0; column < (int)gridColumns; column++) {
+            tSearchWindow& window = subframeLocations[row*gridColumns + column];
+
+            // The search area must stay inside the frame
+            int cx = (2*column + 1)*videoWidth/(2*(int)gridColumns);
+            int cy = (2*row + 1)*videoHeight/(2*(int)gridRows);
+            cx = LMAX(halfWidth + searchFactor, LMIN(videoWidth - 1 - halfWidth - searchFactor, cx));
+            cy = LMAX(halfHeight + searchFactor, LMIN(videoHeight - 1 - halfHeight - searchFactor, cy));
+
+            window.lx = cx - halfWidth;
+            window.rx = cx + halfWidth;
+            window.ly = cy - halfHeight;
+            window.ry = cy + halfHeight;
+        }
+    }
 }
 
-void videoStabilizer::computeCorrelationLocations(uint subframe,
-                                                  uint seedX,
-                                                  uint seedY,
-                                                  uint index,
-                                                  uint hFactor,
-                                                  uint vFactor){
+void videoStabilizer::applyGeometry (){
+    QMutexLocker locker(&searchMutex);
 
-    for (uint yy = 0; yy < 3; yy++){
-        for(uint xx = 0; xx < 3; xx++){
-            correlationMatrix[subframe][index].x = seedX  + (xx*hFactor);
-            correlationMatrix[subframe][index].y = seedY  + (yy*vFactor);
+    if (!geometryChanged)
+        return;
 
-            correlationMatrix[subframe][index].m   = correlationMatrix[subframe][index].x - subframeLocations[subframe].lx;
-            correlationMatrix[subframe][index].n = correlationMatrix[subframe][index].y - subframeLocations[subframe].ly;
-            index++;
-        }
+    geometryChanged = false;
+
+    if (requestedColumns <= 0 || requestedRows <= 0){
+        // 2 x 2 up to 480 lines, 3 x 3 for 720 and 4 x 4 for 1080
+        gridColumns = gridRows = LMAX(2, LMIN(MAX_GRID_SIZE, videoHeight/360 + 1));
+    } else {
+        gridColumns = LMIN(requestedColumns, MAX_GRID_SIZE);
+        gridRows = LMIN(requestedRows, MAX_GRID_SIZE);
+    }
+
+    subframes = gridColumns*gridRows;
+
+    searchFactor = requestedParameters.searchFactor;
+    windowWidth = requestedParameters.windowWidth;
+    windowHeight = requestedParameters.windowHeight;
+    panFactor = requestedParameters.panFactor;
+    maxMotionM = requestedParameters.maxMotionM;
+    maxMotionN = requestedParameters.maxMotionN;
+    locker.unlock();
+
+    // The gray code planes are sized after the search windows
+    computeSearchWindows();
+    allocateAndInitialize();
+}
+
+void videoStabilizer::setParameters(const Parameters& parameters){
+    QMutexLocker locker(&searchMutex);
+
+    // The search area is at most a quarter of the frame, the window takes what is left of it
+    const int factor = LMAX(1, LMIN(LMIN(MAX_SEARCH_FACTOR_P, parameters.searchFactor), LMIN(videoWidth, videoHeight)/4));
+    requestedParameters.searchFactor = factor;
+    requestedParameters.windowWidth = LMAX(8, LMIN(LMIN(64*MAX_WINDOW_WORDS, videoWidth - 2 - 2*factor), parameters.windowWidth));
+    requestedParameters.windowHeight = LMAX(8, LMIN(videoHeight - 2 - 2*factor, parameters.windowHeight));
+    requestedParameters.panFactor = LMAX(0.0, LMIN(1.0, parameters.panFactor));
+    requestedParameters.maxMotionM = LMAX(0, parameters.maxMotionM);
+    requestedParameters.maxMotionN = LMAX(0, parameters.maxMotionN);
+    geometryChanged = true;
+}
+
+videoStabilizer::Parameters videoStabilizer::parameters() const{
+    QMutexLocker locker(&searchMutex);
+    return requestedParameters;
+}
+
+void videoStabilizer::setSubframeGrid(int columns, int rows){
+    QMutexLocker locker(&searchMutex);
+    requestedColumns = columns;
+    requestedRows = rows;
+    geometryChanged = true;
+}
+
+QSize videoStabilizer::subframeGrid() const{
+    QMutexLocker locker(&searchMutex);
+    return QSize(gridColumns, gridRows);
+}
+
+void videoStabilizer::setSearchStrategy(SearchStrategy strategy){
+    QMutexLocker locker(&searchMutex);
+    this->strategy = (strategy >= 0 && strategy < SearchStrategyCount) ? strategy : FullSearch;
+}
+
+videoStabilizer::SearchStrategy videoStabilizer::searchStrategy() const{
+    QMutexLocker locker(&searchMutex);
+    return strategy;
+}
+
+void videoStabilizer::setSearchEvaluation(bool enabled){
+    QMutexLocker locker(&searchMutex);
+    evaluation = enabled;
+}
+
+bool videoStabilizer::isSearchEvaluation() const{
+    QMutexLocker locker(&searchMutex);
+    return evaluation;
+}
+
+videoStabilizer::SearchStatistics videoStabilizer::searchStatistics(SearchStrategy strategy) const{
+    QMutexLocker locker(&searchMutex);
+
+    SearchStatistics statistics;
+    const SearchStatistics& sum = statisticsSum[strategy];
+
+    statistics.frames = sum.frames;
+    statistics.candidates = sum.frames > 0 ? sum.candidates/sum.frames : 0.0;
+    statistics.terminated = sum.frames > 0 ? sum.terminated/sum.frames : 0.0;
+    statistics.rows = sum.frames > 0 ? sum.rows/sum.frames : 0.0;
+    statistics.skippedRows = sum.frames > 0 ? sum.skippedRows/sum.frames : 0.0;
+    statistics.error = evaluatedFrames[strategy] > 0 ? sum.error/evaluatedFrames[strategy] : 0.0;
+    statistics.costRatio = evaluatedFrames[strategy] > 0 ? sum.costRatio/evaluatedFrames[strategy] : 0.0;
+    statistics.time = sum.frames > 0 ? sum.time/sum.frames : 0.0;
+
+    return statistics;
+}
+
+void videoStabilizer::resetSearchStatistics(){
+    QMutexLocker locker(&searchMutex);
+
+    for (int ii = 0; ii < SearchStrategyCount; ii++){
+        statisticsSum[ii] = SearchStatistics();
+        evaluatedFrames[ii] = 0;
     }
 }
 
+void videoStabilizer::setEarlyTermination(bool enabled){
+    QMutexLocker locker(&searchMutex);
+    earlyTermination = enabled;
+}
+
+bool videoStabilizer::isEarlyTermination() const{
+    QMutexLocker locker(&searchMutex);
+    return earlyTermination;
+}
+
+void videoStabilizer::setSubframeWorkers(bool enabled){
+    QMutexLocker locker(&searchMutex);
+    parallelSubframes = enabled;
+}
+
 #if USE_OPENCV
 void videoStabilizer::stabilizeImage(const cv::Mat &imageSrc, cv::Mat &imageDest){
+    cv::Point offset;
+    cv::Mat view = stabilizeView(imageSrc, offset);
+
+    populateImageResult(view, offset, imageDest);
+}
+
+void videoStabilizer::clearOutside(cv::Mat &image, const cv::Rect &region){
+    // Rows above and below, then the columns at both sides of the region
+    image.rowRange(0, region.y).setTo(cv::Scalar::all(0));
+    image.rowRange(region.y + region.height, image.rows).setTo(cv::Scalar::all(0));
+
+    cv::Mat band = image.rowRange(region.y, region.y + region.height);
+    band.colRange(0, region.x).setTo(cv::Scalar::all(0));
+    band.colRange(region.x + region.width, image.cols).setTo(cv::Scalar::all(0));
+}
+
+cv::Mat videoStabilizer::stabilizeView(const cv::Mat &imageSrc, cv::Point &offset){
 
     double tempDuration = static_cast<double>(cv::getTickCount());
     static double tickFreq = static_cast<double>(cv::getTickFrequency());
@@ -178,22 +356,28 @@ void videoStabilizer::stabilizeImage(const cv::Mat &imageSrc, cv::Mat &imageDest
         ticks = timeVal.tms_stime;
 #endif
 
+        applyGeometry();
         convertImageToMatrix(imageSrc);
-        getGrayCode();
         computeCorrelation();
         findMotionVector();
 
 #if USE_OPENCV
-        populateImageResult(imageDest);
+        // The part of the frame still in view after the compensation, moved by it
+        const int shiftM = LMAX(1 - videoWidth, LMIN(videoWidth - 1, va.m));
+        const int shiftN = LMAX(1 - videoHeight, LMIN(videoHeight - 1, va.n));
+
+        offset = cv::Point(LMAX(0, shiftM), LMAX(0, shiftN));
+        cv::Mat view = imageMatrix(cv::Rect(LMAX(0, -shiftM), LMAX(0, -shiftN), videoWidth - abs(shiftM), videoHeight - abs(shiftN)));
 
-        duration += (static_cast<double>(cv::getTickCount()) - tempDuration);
+        duration += static_cast<double>(cv::getTickCount()) - tempDuration;
         aveCount++;
 
         if (aveCount == 10){
             averageTime = (duration/aveCount)/tickFreq;
             aveCount = 0;
             duration = 0;
-            emit gotDuration(averageTime);
+            // By value, the receiver may be on another thread
+            emit gotDuration(1000.0*averageTime);
         }
 
         imageMatrix.release();
@@ -213,6 +397,9 @@ void videoStabilizer::stabilizeImage(const cv::Mat &imageSrc, cv::Mat &imageDest
 
         currentGrayCodeIndex^=1;
 
+#if USE_OPENCV
+        return view;
+#endif
     }
 
     void videoStabilizer::getAverageProcessTime(uint *timeInMs){
@@ -234,73 +421,188 @@ void videoStabilizer::stabilizeImage(const cv::Mat &imageSrc, cv::Mat &imageDest
 
 #endif
 
-    void videoStabilizer::getGrayCode(){
-
-        for (int subframe = 0; subframe < 4; subframe++){
-            getSubframeGrayCode(subframe);
-        }
-    }
-
-
-    void videoStabilizer::getSubframeGrayCode (uchar subframe, BIT_PLANES bitPlane){
-        for (uint jj = subframeLocations[subframe].ly - SEARCH_FACTOR_P;
-             jj < subframeLocations[subframe].ry + SEARCH_FACTOR_P;
-             jj++){
+    void videoStabilizer::processSubframe(uchar subframe, uchar t_m1){
 
 #if USE_OPENCV
-            uchar* gcData= grayCodeMatrix[currentGrayCodeIndex].ptr<uchar>(jj);
-            uchar* imData= imageMatrix.ptr<uchar>(jj);
-#endif
-            for (uint ii = subframeLocations[subframe].lx - SEARCH_FACTOR_P;
-                 ii < subframeLocations[subframe].rx + SEARCH_FACTOR_P;
-                 ii++){
-#if USE_OPENCV
-                //            *(gcData + ii) =  getByteGrayCode( *(imData + ii), bitPlane) == 0? 0: 255;
-                *(gcData + ii) =  getByteGrayCode( *(imData + ii), bitPlane);
+        // Every plane costs about the same as one, the loads are shared
+        getSubframeGrayCodes(subframe);
+        selectSubframePlane(subframe);
 #else
-                grayCodeMatrix[currentGrayCodeIndex][jj].setBit(ii, getByteGrayCode(imageMatrix[jj][ii], bitPlane));
+        getSubframeGrayCode(subframe);
 #endif
+
+        if (evaluating){
+            // The full search goes first, the others are compared with it
+            for (int ii = 0; ii < SearchStrategyCount; ii++){
+                searchSubframe((SearchStrategy)ii, subframe, t_m1);
             }
+        } else {
+            searchSubframe(activeStrategy, subframe, t_m1);
         }
+
+        memcpy(&localMinima[subframe], &strategyMinima[subframe][activeStrategy], sizeof(tcorrMatElement));
     }
 
 
-    inline bool videoStabilizer::getByteGrayCode (uchar value, BIT_PLANES bitPlane){
+    void videoStabilizer::getSubframeGrayCode (uchar subframe, BIT_PLANES bitPlane){
 
         switch (bitPlane){
         case GC_BP_3:
-            return (bool) (((value & GC_BP_3)>>3) ^ ((value & GC_BP_4)>>4));
+            packSubframeGrayCode<3, 1>(subframe);
+            subframePlane[subframe] = 3 - GRAY_CODE_FIRST_PLANE;
             break;
-    case GC_BP_4:
-            return (bool) (((value & GC_BP_4)>>4) ^ ((value & GC_BP_5)>>5));
+        case GC_BP_4:
+            packSubframeGrayCode<4, 1>(subframe);
+            subframePlane[subframe] = 4 - GRAY_CODE_FIRST_PLANE;
             break;
-    case GC_BP_5:
-            return (bool) (((value & GC_BP_5)>>5) ^ ((value & GC_BP_6)>>6));
+        case GC_BP_5:
+            packSubframeGrayCode<5, 1>(subframe);
+            subframePlane[subframe] = 5 - GRAY_CODE_FIRST_PLANE;
             break;
-    case GC_BP_6:
-    default:
-            return (bool) (((value & GC_BP_6)>>6) ^ ((value & GC_BP_7)>>7));
+        case GC_BP_6:
+        default:
+            packSubframeGrayCode<6, 1>(subframe);
+            subframePlane[subframe] = 6 - GRAY_CODE_FIRST_PLANE;
             break;
         }
+    }
+
+    void videoStabilizer::getSubframeGrayCodes (uchar subframe){
+        packSubframeGrayCode<GRAY_CODE_FIRST_PLANE, GRAY_CODE_PLANES>(subframe);
+    }
+
+    template <int First, int Count>
+    void videoStabilizer::packSubframeGrayCode (uchar subframe){
+        // Pixel ox,oy of the image is pixel 0,0 of the subframe planes
+        const uint ox = subframeLocations[subframe].lx - searchFactor;
+        const uint oy = subframeLocations[subframe].ly - searchFactor;
+        const uint width = grayCodeWidth();
+        const uint height = grayCodeHeight();
+        const uint plane = First - GRAY_CODE_FIRST_PLANE;
+
+        for (uint jj = 0; jj < height; jj++){
+
+#if USE_OPENCV
+            const uint planeWords = height*grayCodeStride;
+            quint64* gcData= &grayCodeMatrix[currentGrayCodeIndex][subframe][(plane*height + jj)*grayCodeStride];
+            const uchar* imData= imageMatrix.ptr<uchar>(oy + jj) + ox;
+
+            // Each word is written once, the word after the row stays cleared
+            for (uint word = 0; 64*word < width; word++){
+                quint64 bits[Count];
 
+                packGrayCode64<First, Count>(imData + 64*word, LMIN(64, width - 64*word), bits);
 
+                for (int p = 0; p < Count; p++){
+                    gcData[p*planeWords + word] = bits[p];
+                }
+            }
+#else
+            for (uint ii = 0; ii < width; ii++){
+                const uint gray = imageMatrix[oy + jj][ox + ii] ^ (imageMatrix[oy + jj][ox + ii] >> 1);
+
+                for (int p = 0; p < Count; p++){
+                    grayCodeMatrix[currentGrayCodeIndex][subframe][(plane + p)*height + jj].setBit(ii, (gray >> (First + p)) & 1);
+                }
+            }
+#endif
+        }
     }
 
 #if USE_OPENCV
-    void videoStabilizer::populateImageResult(cv::Mat &imageDest){
+    inline const quint64* videoStabilizer::grayCodeRow (uchar t, uchar subframe, uint y) const{
+        return &grayCodeMatrix[t][subframe][(subframePlane[subframe]*grayCodeHeight() + y)*grayCodeStride];
+    }
+#else
+    inline const QBitArray& videoStabilizer::grayCodeRow (uchar t, uchar subframe, uint y) const{
+        return grayCodeMatrix[t][subframe][subframePlane[subframe]*grayCodeHeight() + y];
+    }
+#endif
+
 
-        //imageDest = grayCodeMatrix[currentGrayCodeIndex];
+#if USE_OPENCV
+    void videoStabilizer::getSubframeWindowBits (uchar subframe){
+        const uint width = subframeLocations[subframe].rx - subframeLocations[subframe].lx;
+        const uint words = (width + 63)/64;
 
-        for (uint ii = (uint)LMAX(0, va.n); ii < (uint)LMIN(videoHeight, videoHeight+va.n); ii ++){
+        windowBits[subframe].resize((subframeLocations[subframe].ry - subframeLocations[subframe].ly)*words);
+        quint64* window = &windowBits[subframe][0];
 
-            uchar* deData= imageDest.ptr<uchar>(ii);
-            uchar* srData= imageMatrix.ptr<uchar>(ii - va.n);
+        // The window starts P pixels into the subframe plane
+        for (uint y = searchFactor; y < searchFactor + subframeLocations[subframe].ry - subframeLocations[subframe].ly; y++){
+            const quint64* row = grayCodeRow(currentGrayCodeIndex, subframe, y);
 
-            for (uint jj = (uint)LMAX(0, va.m); jj < (uint)LMIN (videoWidth, videoWidth+va.m); jj++){
-                *(deData + jj) = *(srData + jj - va.m);
-            }// for jj
-        } // for ii
+            for (uint word = 0; word < words; word++){
+                *window++ = extractBits64(row, searchFactor + 64*word) & windowMask(width, word);
+            }
+        }
+    }
+
+    void videoStabilizer::selectSubframePlane (uchar subframe){
+        const uint width = subframeLocations[subframe].rx - subframeLocations[subframe].lx;
+        const uint height = subframeLocations[subframe].ry - subframeLocations[subframe].ly;
+        const uint minimum = (uint)(GRAY_CODE_MIN_TEXTURE*((width - 1)*height + width*(height - 1)));
+
+        uchar textured = 0;
+        uint mostEdges = 0;
+
+        for (int plane = GRAY_CODE_PLANES - 1; plane >= 0; plane--){
+            subframePlane[subframe] = plane;
+            getSubframeWindowBits(subframe);
 
+            uint edges = getSubframeWindowTexture(subframe);
+
+            if (edges >= minimum)
+                return;
+
+            if (edges > mostEdges){
+                mostEdges = edges;
+                textured = plane;
+            }
+        }
+
+        // The lowest plane is still packed
+        if (textured != 0){
+            subframePlane[subframe] = textured;
+            getSubframeWindowBits(subframe);
+        }
+    }
+
+    uint videoStabilizer::getSubframeWindowTexture (uchar subframe){
+        const uint width = subframeLocations[subframe].rx - subframeLocations[subframe].lx;
+        const uint words = (width + 63)/64;
+        const int count = windowBits[subframe].size();
+        const quint64* window = &windowBits[subframe][0];
+
+        // Vertical edges, each row against the next one
+        uint edges = hammingDistance(window, window + words, count - words);
+
+        // Horizontal edges, each pixel against the next one, the last of a word against the first of the next
+        for (int ii = 0; ii < count; ii++){
+            uint word = ii % words;
+
+            if (word + 1 < words){
+                edges += popCount64(window[ii] ^ (window[ii] >> 1 | window[ii + 1] << 63));
+            } else {
+                edges += popCount64((window[ii] ^ (window[ii] >> 1)) & windowMask(width - 1, word));
+            }
+        }
+
+        return edges;
+    }
+#endif
+
+#if USE_OPENCV
+    void videoStabilizer::populateImageResult(const cv::Mat &view, const cv::Point &offset, cv::Mat &imageDest){
+
+        // Only allocated when the size changes, and only the border left by the shift is cleared
+        imageDest.create(videoHeight, videoWidth, view.type());
+
+        cv::Rect region(offset, view.size());
+        clearOutside(imageDest, region);
+
+        cv::Mat target = imageDest(region);
+        view.copyTo(target);
     }
 #else
     void videoStabilizer::populateImageResult(QImage* imageDest){
@@ -317,117 +619,448 @@ void videoStabilizer::stabilizeImage(const cv::Mat &imageSrc, cv::Mat &imageDest
     void videoStabilizer::computeCorrelation(){
 
         uchar t_m1 = currentGrayCodeIndex ^ 1;
-        memset(localMinima,0,4*sizeof(tcorrMatElement));
+        memset(localMinima, 0, sizeof(localMinima));
 
-        for (uchar subframe = 0; subframe < 4; subframe++) {
+        bool parallel;
 
-#if DO_FULL_CORRELATION
+        {
+            QMutexLocker locker(&searchMutex);
+            activeStrategy = strategy;
+            evaluating = evaluation;
+            terminating = earlyTermination;
+            parallel = parallelSubframes;
+        }
+
+        if (parallel){
+            // The results do not depend on which thread runs each subframe
+            QSemaphore finished;
+
+            for (uchar subframe = 1; subframe < subframes; subframe++) {
+                subframeWorkers()->start(new SubframeJob(this, subframe, t_m1, &finished));
+            }
+
+            processSubframe(0, t_m1);
 
-            computeFullCorrelation(subframe, t_m1);
+            finished.acquire(subframes - 1);
+        } else {
+            for (uchar subframe = 0; subframe < subframes; subframe++) {
+                processSubframe(subframe, t_m1);
+            }
+        }
+
+#if USE_OPENCV
+        static double tickFreq = static_cast<double>(cv::getTickFrequency());
 #else
+        static double tickFreq = 1.0;
+#endif
+
+        QMutexLocker locker(&searchMutex);
+
+        for (int ii = 0; ii < SearchStrategyCount; ii++){
+            if (!evaluating && ii != activeStrategy)
+                continue;
 
-            computeSubframeCorrelation(0, subframe, t_m1);
+            SearchStatistics& sum = statisticsSum[ii];
+            sum.frames++;
 
-            computeCorrelationLocations(subframe,
-                                        localMinima[subframe].x - searchFactorWindow,
-                                        localMinima[subframe].y - searchFactorWindow,
-                                        9,
-                                        searchFactorWindow,
-                                        searchFactorWindow);
+            for (uchar subframe = 0; subframe < subframes; subframe++) {
+                const tSearchCounters& counters = strategyCounters[subframe][ii];
+
+                sum.candidates += counters.candidates/(double)subframes;
+                sum.terminated += counters.terminated/(double)subframes;
+                sum.rows += counters.rows/(double)subframes;
+                sum.skippedRows += counters.skippedRows/(double)subframes;
+                sum.time += 1000.0*counters.ticks/tickFreq;
+            }
 
-            // TODO: to enable this I need new matrices for each bitplane xor
-            //getSubframeGrayCode(subframe,GC_BP_4);
+            if (!evaluating)
+                continue;
 
-            computeSubframeCorrelation(9,subframe,t_m1);
+            evaluatedFrames[ii]++;
+
+            for (uchar subframe = 0; subframe < subframes; subframe++) {
+                const tcorrMatElement& found = strategyMinima[subframe][ii];
+                const tcorrMatElement& reference = strategyMinima[subframe][FullSearch];
+
+                sum.error += (abs(found.m - reference.m) + abs(found.n - reference.n))/(double)subframes;
+                sum.costRatio += (found.value + 1.0)/(reference.value + 1.0)/subframes;
+            }
+        }
+    }
+
+    void videoStabilizer::searchSubframe (SearchStrategy strategy, uchar subframe, uchar tm_1){
+
+#if USE_OPENCV
+        const double startTicks = static_cast<double>(cv::getTickCount());
 #endif
+
+        // No offset is matched yet, the strategies being compared do not share their matches
+        // so each one pays for the offsets it would match alone
+        for (uint ii = 0; ii < fullCorrelationMatrix[subframe].size(); ii++){
+            fullCorrelationMatrix[subframe][ii].value = UINT_MAX;
         }
+        partialOffsets[subframe].assign(partialOffsets[subframe].size(), 0);
+        visitedOffsets[subframe].assign(visitedOffsets[subframe].size(), 0);
+        memset(&searchCounters[subframe], 0, sizeof(tSearchCounters));
+
+        tcorrMatElement* best = &strategyMinima[subframe][strategy];
+        memset(best, 0, sizeof(tcorrMatElement));
+        best->value = UINT_MAX;
+
+        switch (strategy){
+        case ThreeStepSearch:
+            searchThreeStep(subframe, tm_1, best);
+            break;
+        case DiamondSearch:
+            searchDiamond(subframe, tm_1, best);
+            break;
+        case HierarchicalSearch:
+            searchHierarchical(subframe, tm_1, best);
+            break;
+        case PredictiveSearch:
+            searchPredictive(subframe, tm_1, best);
+            break;
+        case FullSearch:
+        default:
+            searchFull(subframe, tm_1, best);
+            break;
+        }
+
+#if USE_OPENCV
+        searchCounters[subframe].ticks = static_cast<double>(cv::getTickCount()) - startTicks;
+#endif
+
+        memcpy(&strategyCounters[subframe][strategy], &searchCounters[subframe], sizeof(tSearchCounters));
     }
 
-    void videoStabilizer::computeSubframeCorrelation (uint index, uchar subframe, uchar t_m1){
+    void videoStabilizer::searchFull (uchar subframe, uchar tm_1, tcorrMatElement* best){
 
-        localMinima[subframe].value = UINT_MAX;
+        // From the previous vector outwards, a low cost found first stops the other matches early
+        const int cm = LMAX(-searchFactor, LMIN(searchFactor, vg_tm1.m));
+        const int cn = LMAX(-searchFactor, LMIN(searchFactor, vg_tm1.n));
 
-        for (uint corrIndex = index; corrIndex < (index + 9); corrIndex++){
-            correlationMatrix[subframe][corrIndex].value = 0;
+        for (int radius = 0; radius <= searchFactor + LMAX(abs(cm), abs(cn)); radius++){
+            searchRing(subframe, tm_1, cm, cn, radius, best);
+        }
+    }
+
+    void videoStabilizer::searchRing (uchar subframe, uchar tm_1, int cm, int cn, int radius, tcorrMatElement* best){
+
+        if (radius == 0){
+            tryCandidate(subframe, tm_1, cm, cn, best);
+            return;
+        }
 
-            computeSingleCorrelation(subframe, t_m1,&correlationMatrix[subframe][corrIndex]);
+        for (int m = cm - radius; m <= cm + radius; m++){
+            tryCandidate(subframe, tm_1, m, cn - radius, best);
+            tryCandidate(subframe, tm_1, m, cn + radius, best);
+        }
 
-            // find the minimimum
-            if (localMinima[subframe].value > correlationMatrix[subframe][corrIndex].value){
-                memcpy(&localMinima[subframe], &(correlationMatrix[subframe][corrIndex]), sizeof(tcorrMatElement));
-            } // if localMinima
+        for (int n = cn - radius + 1; n < cn + radius; n++){
+            tryCandidate(subframe, tm_1, cm - radius, n, best);
+            tryCandidate(subframe, tm_1, cm + radius, n, best);
         }
     }
 
+    void videoStabilizer::searchThreeStep (uchar subframe, uchar tm_1, tcorrMatElement* best){
+
+        // The first spacing covers half the window, so three steps reach its border for P = 7
+        int step = 1;
+
+        while (2*step <= searchFactor){
+            step *= 2;
+        }
 
-    void videoStabilizer::computeFullCorrelation (uchar subframe, uchar tm_1){
+        tryCandidate(subframe, tm_1, 0, 0, best);
 
-        localMinima[subframe].value = UINT_MAX;
+        for (; step > 0; step /= 2){
+            int m = best->m;
+            int n = best->n;
 
-        for (int m = 0; m < 2*SEARCH_FACTOR_P+1; m++ ){
-            for (int n = 0; n < 2*SEARCH_FACTOR_P+1; n++){
-                fullCorrelationMatrix[subframe][n][m].value = 0;
+            for (int dn = -1; dn <= 1; dn++){
+                for (int dm = -1; dm <= 1; dm++){
+                    tryCandidate(subframe, tm_1, m + dm*step, n + dn*step, best);
+                }
+            }
+        }
+    }
 
-                computeSingleCorrelation(subframe,tm_1,&fullCorrelationMatrix[subframe][n][m]);
+    void videoStabilizer::searchDiamond (uchar subframe, uchar tm_1, tcorrMatElement* best){
 
-                // find the minimimum
-                if (localMinima[subframe].value > fullCorrelationMatrix[subframe][n][m].value){
-                    memcpy(&localMinima[subframe], &(fullCorrelationMatrix[subframe][n][m]), sizeof(tcorrMatElement));
-                } // if localMinima
+        static const int largeDiamond[8][2] = {{0,-2}, {1,-1}, {2,0}, {1,1}, {0,2}, {-1,1}, {-2,0}, {-1,-1}};
+        static const int smallDiamond[4][2] = {{0,-1}, {1,0}, {0,1}, {-1,0}};
+
+        tryCandidate(subframe, tm_1, 0, 0, best);
+
+        // Each move lowers the cost, so the large diamond stops
+        forever {
+            int m = best->m;
+            int n = best->n;
+
+            for (int ii = 0; ii < 8; ii++){
+                tryCandidate(subframe, tm_1, m + largeDiamond[ii][0], n + largeDiamond[ii][1], best);
             }
+
+            if (best->m == m && best->n == n)
+                break;
+        }
+
+        int m = best->m;
+        int n = best->n;
+
+        for (int ii = 0; ii < 4; ii++){
+            tryCandidate(subframe, tm_1, m + smallDiamond[ii][0], n + smallDiamond[ii][1], best);
         }
     }
 
-    inline void videoStabilizer::computeSingleCorrelation (uchar subframe, uchar t_m1, tcorrMatElement* element){
-        for (uint y = subframeLocations[subframe].ly;
-             y < subframeLocations[subframe].ry;
-             y++) {  // y is height
-#if USE_OPENCV
-            uchar* data     = grayCodeMatrix[currentGrayCodeIndex].ptr<uchar>(y);
-            uchar* data_tm1 = grayCodeMatrix[t_m1].ptr<uchar>( y + element->n);
-#endif
+    void videoStabilizer::searchHierarchical (uchar subframe, uchar tm_1, tcorrMatElement* best){
+
+        tcorrMatElement coarse;
+        memset(&coarse, 0, sizeof(tcorrMatElement));
+        coarse.value = UINT_MAX;
+
+        // Coarse level, not kept in the correlation matrix since it only matches half the rows
+        for (int m = -searchFactor; m <= searchFactor; m += 2){
+            for (int n = -searchFactor; n <= searchFactor; n += 2){
+                tcorrMatElement element;
+                memset(&element, 0, sizeof(tcorrMatElement));
+                element.m = m;
+                element.n = n;
+
+                computeSingleCorrelation(subframe, tm_1, &element, coarse.value, 2);
+                searchCounters[subframe].candidates++;
+
+                if (element.value < coarse.value){
+                    memcpy(&coarse, &element, sizeof(tcorrMatElement));
+                }
+            }
+        }
+
+        // Fine level around the coarse offset
+        for (int dn = -1; dn <= 1; dn++){
+            for (int dm = -1; dm <= 1; dm++){
+                tryCandidate(subframe, tm_1, coarse.m + dm, coarse.n + dn, best);
+            }
+        }
+    }
+
+    void videoStabilizer::searchPredictive (uchar subframe, uchar tm_1, tcorrMatElement* best){
+
+        // The global vector is only written between frames, after every subframe finished
+        const int cm = LMAX(-searchFactor, LMIN(searchFactor, vg_tm1.m));
+        const int cn = LMAX(-searchFactor, LMIN(searchFactor, vg_tm1.n));
+        const uint poorCost = (uint)(PREDICTIVE_POOR_COST*(subframeLocations[subframe].rx - subframeLocations[subframe].lx)*
+                                     (subframeLocations[subframe].ry - subframeLocations[subframe].ly));
+
+        // When the camera stops the prediction is off by the whole vector
+        tryCandidate(subframe, tm_1, 0, 0, best);
+
+        int searched = -1;
+
+        for (int radius = PREDICTIVE_RADIUS; ; radius = LMIN(2*radius, 2*searchFactor)){
+            // Only the rings added to the window
+            for (int ring = searched + 1; ring <= radius; ring++){
+                searchRing(subframe, tm_1, cm, cn, ring, best);
+            }
+            searched = radius;
+
+            if (radius >= 2*searchFactor)
+                break;
+
+            // A border offset may be the slope towards a better one outside the window
+            bool borderM = abs(best->m - cm) == radius && abs(best->m) < searchFactor;
+            bool borderN = abs(best->n - cn) == radius && abs(best->n) < searchFactor;
+
+            if (!borderM && !borderN && best->value <= poorCost)
+                break;
+        }
+    }
+
+    bool videoStabilizer::tryCandidate (uchar subframe, uchar tm_1, int m, int n, tcorrMatElement* best){
+
+        if (m < -searchFactor || m > searchFactor || n < -searchFactor || n > searchFactor)
+            return false;
+
+        const int offset = (n + searchFactor)*(2*searchFactor + 1) + m + searchFactor;
+        tcorrMatElement* element = &fullCorrelationMatrix[subframe][offset];
+
+        uchar* partial = &partialOffsets[subframe][offset];
+
+        if (!visitedOffsets[subframe][offset]){
+            visitedOffsets[subframe][offset] = 1;
+            searchCounters[subframe].candidates++;
+        }
+
+        // A partial cost is a lower bound, it is only matched again if it could still be lower
+        if (element->value == UINT_MAX || (*partial && element->value < best->value)){
+            element->value = 0;
+            *partial = !computeSingleCorrelation(subframe, tm_1, element, best->value);
+        }
+
+        // find the minimimum
+        if (!*partial && best->value > element->value){
+            memcpy(best, element, sizeof(tcorrMatElement));
+            return true;
+        }
+
+        return false;
+    }
 
-            for (uint x = subframeLocations[subframe].lx;
-                 x < subframeLocations[subframe].rx;
-                 x++) {     // x is width
 #if USE_OPENCV
-                element->value += *(data + x) ^ *(data_tm1 + x + element->m);
+    inline bool videoStabilizer::computeSingleCorrelation (uchar subframe, uchar t_m1, tcorrMatElement* element, uint bound, uint rowStep){
+        if (!terminating)
+            bound = UINT_MAX;
+
+        // Windows up to 128 pixels wide have their own unrolled match
+        switch ((subframeLocations[subframe].rx - subframeLocations[subframe].lx + 63)/64){
+        case 1:
+            return matchWindow<1>(subframe, t_m1, element, bound, rowStep);
+        case 2:
+            return matchWindow<2>(subframe, t_m1, element, bound, rowStep);
+        default:
+            return matchWindow<0>(subframe, t_m1, element, bound, rowStep);
+        }
+    }
+
+    template <int Words>
+    inline bool videoStabilizer::matchWindow (uchar subframe, uchar t_m1, tcorrMatElement* element, uint bound, uint rowStep){
+        const uint width = subframeLocations[subframe].rx - subframeLocations[subframe].lx;
+        const uint words = Words > 0 ? Words : (width + 63)/64;
+        const uint lx = searchFactor + element->m;
+        const uint rows = (subframeLocations[subframe].ry - subframeLocations[subframe].ly + rowStep - 1)/rowStep;
+        const quint64* window = &windowBits[subframe][0];
+
+        quint64 masks[MAX_WINDOW_WORDS];
+
+        for (uint word = 0; word < words; word++){
+            masks[word] = windowMask(width, word);
+        }
+
+        // A row of the window at t-1 shifted by m,n, packed like the one at t
+        quint64 candidate[MAX_WINDOW_WORDS];
+
+        for (uint row = 0; row < rows; row++) {
+            const uint y = searchFactor + row*rowStep;  // y is height in the subframe plane
+            const quint64* source = grayCodeRow(t_m1, subframe, y + element->n);
+            const quint64* windowRow = window + row*rowStep*words;
+
+            if (Words > 0){
+                for (uint word = 0; word < words; word++){
+                    element->value += popCount64(windowRow[word] ^ (extractBits64(source, lx + 64*word) & masks[word]));
+                }
+            } else {
+                for (uint word = 0; word < words; word++){
+                    candidate[word] = extractBits64(source, lx + 64*word) & masks[word];
+                }
+
+                element->value += hammingDistance(windowRow, candidate, words);
+            }
+
+            // It can not be the minimum anymore
+            if (element->value >= bound){
+                searchCounters[subframe].rows += row + 1;
+                searchCounters[subframe].skippedRows += rows - row - 1;
+                searchCounters[subframe].terminated++;
+                return false;
+            }
+        }
+
+        searchCounters[subframe].rows += rows;
+        return true;
+    }
 #else
-                element->value += grayCodeMatrix[currentGrayCodeIndex][y].testBit(x) ^
-                                  grayCodeMatrix[t_m1][y+element->n].testBit(x+element->m);
+    inline bool videoStabilizer::computeSingleCorrelation (uchar subframe, uchar t_m1, tcorrMatElement* element, uint bound, uint rowStep){
+        const uint rows = (subframeLocations[subframe].ry - subframeLocations[subframe].ly + rowStep - 1)/rowStep;
 
-#endif
+        if (!terminating)
+            bound = UINT_MAX;
+
+        for (uint row = 0; row < rows; row++) {
+            const uint y = searchFactor + row*rowStep;  // y is height in the subframe plane
+
+            for (uint x = searchFactor;
+                 x < searchFactor + subframeLocations[subframe].rx - subframeLocations[subframe].lx;
+                 x++) {     // x is width
+                element->value += grayCodeRow(currentGrayCodeIndex, subframe, y).testBit(x) ^
+                                  grayCodeRow(t_m1, subframe, y+element->n).testBit(x+element->m);
+            }
+
+            // It can not be the minimum anymore
+            if (element->value >= bound){
+                searchCounters[subframe].rows += row + 1;
+                searchCounters[subframe].skippedRows += rows - row - 1;
+                searchCounters[subframe].terminated++;
+                return false;
             }
         }
+
+        searchCounters[subframe].rows += rows;
+        return true;
     }
+#endif
 
     void videoStabilizer::findMotionVector (){
 
-        int sortedMinimaM[5];
-        int sortedMinimaN[5];
+        // Each subframe votes with its vector, the last motion vector too
+        const int voters = subframes + 1;
+        int votesM[MAX_SUBFRAMES + 1];
+        int votesN[MAX_SUBFRAMES + 1];
 
-        for (int x = 0; x < 4; x++) {
-            sortedMinimaM[x] = localMinima[x].m;
-            sortedMinimaN[x] = localMinima[x].n;
+        for (uint x = 0; x < subframes; x++) {
+            votesM[x] = localMinima[x].m;
+            votesN[x] = localMinima[x].n;
         }
-        sortedMinimaM[4] = vg_tm1.m;
-        sortedMinimaN[4] = vg_tm1.n;
+        votesM[subframes] = vg_tm1.m;
+        votesN[subframes] = vg_tm1.n;
+
+        // The vector backed by most voters wins, a tie goes to the closest to the last vector
+        int winner = subframes;
+        int support = 0;
 
+        for (int ii = 0; ii < voters; ii++) {
+            int count = 0;
+
+            for (int jj = 0; jj < voters; jj++) {
+                if (abs(votesM[jj] - votesM[ii]) <= VOTE_TOLERANCE && abs(votesN[jj] - votesN[ii]) <= VOTE_TOLERANCE)
+                    count++;
+            }
+
+            int distance = LMAX(abs(votesM[ii] - vg_tm1.m), abs(votesN[ii] - vg_tm1.n));
+            int winnerDistance = LMAX(abs(votesM[winner] - vg_tm1.m), abs(votesN[winner] - vg_tm1.n));
+
+            if (count > support || (count == support && distance < winnerDistance)){
+                support = count;
+                winner = ii;
+            }
+        }
+
+        // The others, such as moving objects, are left out of the median
+        int sortedMinimaM[MAX_SUBFRAMES + 1];
+        int sortedMinimaN[MAX_SUBFRAMES + 1];
+        int inliers = 0;
+
+        for (int jj = 0; jj < voters; jj++) {
+            if (abs(votesM[jj] - votesM[winner]) <= VOTE_TOLERANCE && abs(votesN[jj] - votesN[winner]) <= VOTE_TOLERANCE){
+                sortedMinimaM[inliers] = votesM[jj];
+                sortedMinimaN[inliers] = votesN[jj];
+                inliers++;
+            }
+        }
 
-        sortLocalMinima(sortedMinimaM, 0, 5);
-        sortLocalMinima(sortedMinimaN, 0, 5);
+        sortLocalMinima(sortedMinimaM, 0, inliers);
+        sortLocalMinima(sortedMinimaN, 0, inliers);
 
-        va.m = PAN_FACTOR_D*va_tm1.m + sortedMinimaM[2];
-        va.n = PAN_FACTOR_D*va_tm1.n + sortedMinimaN[2];
+        va.m = panFactor*va_tm1.m + sortedMinimaM[inliers/2];
+        va.n = panFactor*va_tm1.n + sortedMinimaN[inliers/2];
 
-        va.m = va.m > MAX_M_MOTION ? MAX_M_MOTION : va.m;
-        va.m = va.m < -MAX_M_MOTION ? -MAX_M_MOTION : va.m;
+        va.m = va.m > maxMotionM ? maxMotionM : va.m;
+        va.m = va.m < -maxMotionM ? -maxMotionM : va.m;
 
-        va.n = va.n > MAX_N_MOTION ? MAX_N_MOTION : va.n;
-        va.n = va.n < -MAX_N_MOTION ? -MAX_N_MOTION : va.n;
+        va.n = va.n > maxMotionN ? maxMotionN : va.n;
+        va.n = va.n < -maxMotionN ? -maxMotionN : va.n;
 
-        vg_tm1.m = sortedMinimaM[2];
-        vg_tm1.n = sortedMinimaN[2];
+        vg_tm1.m = sortedMinimaM[inliers/2];
+        vg_tm1.n = sortedMinimaN[inliers/2];
 
         memcpy(&va_tm1, &va, sizeof(tcorrMatElement));
 
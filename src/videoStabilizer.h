@@ -11,7 +11,9 @@
 #include <QObject>
 #include <QImage>
 #include <QBitArray>
+#include <QMutex>
 #include <limits>
+#include <vector>
 
 #define USE_OPENCV 1
 
@@ -27,9 +29,24 @@
 #define VERT_WINDOW_N           25
 #define PAN_FACTOR_D            0.95
 
+#define MAX_GRID_SIZE           4
+#define MAX_SUBFRAMES           (MAX_GRID_SIZE*MAX_GRID_SIZE)
+#define WINDOW_CELL_DIVISOR     8
+#define MAX_WINDOW_WORDS        4
+#define VOTE_TOLERANCE          1
+
+#define GRAY_CODE_FIRST_PLANE   3
+#define GRAY_CODE_PLANES        4
+#define GRAY_CODE_MIN_TEXTURE   0.1
+
+#define PREDICTIVE_RADIUS       1
+#define PREDICTIVE_POOR_COST    0.2
+
 #define MAX_M_MOTION            65
 #define MAX_N_MOTION            65
 
+#define MAX_SEARCH_FACTOR_P     15
+
 
 /**
 source: http://developer.gnome.org/glib/2.31/glib-Standard-Macros.html#MAX:CAPS
@@ -38,11 +55,12 @@ source: http://developer.gnome.org/glib/2.31/glib-Standard-Macros.html#MAX:CAPS
 #define LMIN(a, b)  (((a) < (b)) ? (a) : (b))
 
 
-#define DO_FULL_CORRELATION     1
+class SubframeJob;
 
 class videoStabilizer : public QObject
 {
     Q_OBJECT
+    friend class SubframeJob;
 public:
     /**
       This is the class constructor
@@ -52,13 +70,148 @@ public:
 
     ~videoStabilizer( );
 
+    /**
+        The block search used to find the motion of each subframe
+
+        @enum SearchStrategy
+    */
+    enum SearchStrategy {
+        /** Every offset of the search window, the reference */
+        FullSearch = 0,
+        /** Three steps of 9 offsets, halving the spacing around the best one */
+        ThreeStepSearch,
+        /** Large diamond moved to its best offset until it stays, then a small diamond */
+        DiamondSearch,
+        /** Every other offset matched on every other row, then the offsets around the best one */
+        HierarchicalSearch,
+        /** Small window around the previous global vector, grown while the match is poor */
+        PredictiveSearch,
+        SearchStrategyCount
+    };
+
+    /** Cost and accuracy of a search strategy on the frames stabilized */
+    struct SearchStatistics {
+        SearchStatistics() : frames(0), candidates(0.0), terminated(0.0), rows(0.0), skippedRows(0.0),
+            error(0.0), costRatio(0.0), time(0.0) {}
+
+        /** Frames the strategy searched */
+        quint64 frames;
+        /** Average offsets matched per subframe */
+        double candidates;
+        /** Average offsets per subframe whose match stopped early */
+        double terminated;
+        /** Average window rows compared per subframe */
+        double rows;
+        /** Average window rows per subframe not compared thanks to the early stop */
+        double skippedRows;
+        /** Average distance in pixels of the subframe vectors to the ones of the full search */
+        double error;
+        /** Average match cost of the subframe vectors over the one of the full search */
+        double costRatio;
+        /** Average milliseconds per frame spent searching, added over the subframes */
+        double time;
+    };
+
+    /**
+        Sets the search used from the next frame
+
+    @param  strategy    The search strategy
+    */
+    void setSearchStrategy(SearchStrategy strategy);
+    /** Return the search in use */
+    SearchStrategy searchStrategy() const;
+    /**
+        Runs every strategy on each frame besides the one in use, to compare their cost and
+        accuracy on the same stream. Each one matches its offsets on its own, so its cost is the
+        one it has alone. It costs more than the full search, only for evaluation.
+
+    @param  enabled     Enable the evaluation
+    */
+    void setSearchEvaluation(bool enabled);
+    /** Return true if every strategy runs on each frame */
+    bool isSearchEvaluation() const;
+    /**
+        Return the cost and accuracy of a strategy since the statistics were reset. The error
+        and cost ratio are only known from the frames searched with the evaluation enabled.
+
+    @param  strategy    The search strategy
+    */
+    SearchStatistics searchStatistics(SearchStrategy strategy) const;
+    /** Forgets the statistics of every strategy */
+    void resetSearchStatistics();
+    /**
+        Sets the grid of subframes searched from the next frame, one window at the center of
+        each cell. Each window is an eighth of its cell, at least M x N.
+
+    @param  columns, rows   The cells of the grid, up to MAX_GRID_SIZE, 0 chooses them from the height
+    */
+    void setSubframeGrid(int columns, int rows);
+
+    /** Size of the search and of the windows, and limits of the compensation */
+    struct Parameters {
+        Parameters() : searchFactor(SEARCH_FACTOR_P), windowWidth(HORIZ_WINDOW_M), windowHeight(VERT_WINDOW_N),
+            panFactor(PAN_FACTOR_D), maxMotionM(MAX_M_MOTION), maxMotionN(MAX_N_MOTION) {}
+
+        /** Largest offset searched in each axis, P, up to MAX_SEARCH_FACTOR_P */
+        int searchFactor;
+        /** Smallest size of the subframe windows, M x N, larger frames get larger ones */
+        int windowWidth;
+        int windowHeight;
+        /** Share of the last compensation kept in the next one, D, from 0 to 1 */
+        double panFactor;
+        /** Largest compensation in each axis */
+        int maxMotionM;
+        int maxMotionN;
+    };
+
+    /**
+        Sets the parameters used from the next frame, the motion found so far is forgotten
+
+    @param  parameters  The parameters, limited to the supported ranges and to the size of the frame
+    */
+    void setParameters(const Parameters& parameters);
+    /** Return the parameters set, the defaults are the values #defined in this header */
+    Parameters parameters() const;
+    /** Return the columns and rows of the grid in use */
+    QSize subframeGrid() const;
+    /**
+        Stops matching an offset once its partial cost reaches the best one found, the vectors
+        found are the same. Enabled by default, disabled only to measure its gain.
+
+    @param  enabled     Enable the early termination
+    */
+    void setEarlyTermination(bool enabled);
+    /** Return true if the matches stop early */
+    bool isEarlyTermination() const;
+    /**
+        Searches the subframes on threads of their own, the default. Disabled when the frame is
+        already processed on a shared worker, which then does every subframe within its budget.
+
+    @param  enabled     Enable the subframe workers
+    */
+    void setSubframeWorkers(bool enabled);
+
 
 signals:
-    void gotDuration (double &durationInMs);
+    void gotDuration (double durationInMs);
 
 public slots:
 #if USE_OPENCV
+    /**
+        Stabilizes a frame into imageDest, which is only allocated when its size changes. The
+        rows are copied whole and only the border left by the compensation is cleared.
+    */
     void stabilizeImage(const cv::Mat &imageSrc, cv::Mat &imageDest);
+    /**
+        Stabilizes a frame without copying it, the caller draws the view at the offset
+
+    @param  imageSrc    The frame, gray
+    @param  offset      Receives the position of the view in the stabilized frame
+    @return The part of imageSrc still in view after the compensation, it shares its pixels
+    */
+    cv::Mat stabilizeView(const cv::Mat &imageSrc, cv::Point &offset);
+    /** Clears the pixels of an image outside a region */
+    static void clearOutside(cv::Mat &image, const cv::Rect &region);
 #else
     void stabilizeImage(QImage* imageSrc, QImage* imageDest);
 #endif
@@ -67,7 +220,8 @@ public slots:
 private:
 
 #if USE_OPENCV
-    typedef cv::Mat  tGrayCodeMat;
+    /** Gray code bits packed 64 pixels per word, rows of grayCodeStride words */
+    typedef std::vector<quint64>  tGrayCodeMat;
 
     typedef cv::Mat tImageMat;
 
@@ -95,6 +249,19 @@ private:
         uint      value;
     }tcorrMatElement;
 
+    /** Work of a search on a subframe */
+    typedef struct _tSearchCounters{
+        /** Offsets matched */
+        uint    candidates;
+        /** Matches stopped early */
+        uint    terminated;
+        /** Window rows compared and not compared */
+        uint    rows;
+        uint    skippedRows;
+        /** Ticks spent searching */
+        double  ticks;
+    }tSearchCounters;
+
     typedef struct _tSearchWindow{
         uint    lx;
         uint    ly;
@@ -120,7 +287,7 @@ private:
     }BIT_PLANES;
 
     /**
-       Computes the size of the four search windows (one for each subframe) as follows
+       Computes the search windows, one for each cell of the grid, as follows
 
                -------------------------------------------------
                |       P                               P       |
@@ -142,6 +309,12 @@ private:
 
     */
     void computeSearchWindows ();
+    /** Applies the grid and parameters asked since the last frame and allocates the subframes */
+    void applyGeometry ();
+
+    /** Return the width and height of a subframe gray code plane, its window plus P on each side */
+    uint grayCodeWidth () const;
+    uint grayCodeHeight () const;
 
     /**
         Allocates the required memory and initializes all the data members
@@ -149,29 +322,40 @@ private:
     void allocateAndInitialize();
 
     /**
-      Computes 9 indexes of the correlation location. These come in blocks of 9 as described
-      in the 3SS method.
-
-      @param    subframe The subframe being used
-      @param    seedX   X coordinate of UL point in the 9-point grid
-      @param    seedY   Y coordinate of UL point in the 9-point grid
-      @param    index   It indicates which is the start index for the corr mat
-      @param    hFactor It indicates the horizontal spacing between sample points
-      @param    vFactor It inidcates the vertical spacing between sample points
-    */
-    void computeCorrelationLocations(uint subframe, uint seedX, uint seedY, uint index, uint hFactor, uint vFactor);
+      This function computes the graycode of a subframe of the current working image and
+      searches its motion. Subframes only touch their own data, so they run concurrently.
 
-    /**
-      This function computes the graycode of the current working image
+    @param  subframe    The subframe being computed
+    @param  t_m1        The index of time t-1 in the gray code matrix
    */
-    void getGrayCode();
+    void processSubframe(uchar subframe, uchar t_m1);
 
     /**
-        This function computes the gray code of each subframe's search window
+        This function computes the gray code of each subframe's search window, and uses its
+    bit plane for the search
 
     @param  subframe    The subframe for which to compute the gray code of size (M+2*p) x (N+2*p)
+    @param  bitPlane    The bitplane, from GC_BP_3 to GC_BP_6
     */
     void getSubframeGrayCode (uchar subframe, BIT_PLANES bitPlane = GC_BP_4);
+    /**
+        This function computes the GRAY_CODE_PLANES bit planes of a subframe's search window in one pass
+
+    @param  subframe    The subframe for which to compute the gray code of size (M+2*p) x (N+2*p)
+    */
+    void getSubframeGrayCodes (uchar subframe);
+    /**
+        This function packs the bit planes First to First + Count - 1 of a subframe's search window,
+    the bit planes are fixed when building so the loop does not branch on them
+    */
+    template <int First, int Count>
+    void packSubframeGrayCode (uchar subframe);
+    /** Return a row of the bit plane used by a subframe, y is relative to its search area */
+#if USE_OPENCV
+    inline const quint64* grayCodeRow (uchar t, uchar subframe, uint y) const;
+#else
+    inline const QBitArray& grayCodeRow (uchar t, uchar subframe, uint y) const;
+#endif
 
 
     /**
@@ -187,15 +371,6 @@ private:
 #endif
 
 
-    /**
-        This function computes the Gray Code for a single byte
-
-    @param  value       The 8bit value to be used in the Gray code calculation. The
-                        bitplanes used are #defined in the header file.
-    @param  bitPlane    The bitplane used to compute the graycode @see @enum BIT_PLANES
-    */
-    inline bool getByteGrayCode(uchar value, BIT_PLANES bitPlane = GC_BP_4);
-
     /**
         This function creates the de-rotated image to paint.
 
@@ -206,52 +381,109 @@ private:
     @param  imageDest   The QImage where the final result will be painted on.
     */
 #if USE_OPENCV
-    void populateImageResult(cv::Mat &imageDest);
+    void populateImageResult(const cv::Mat &view, const cv::Point &offset, cv::Mat &imageDest);
 #else
     void populateImageResult(QImage* imageDest);
 #endif
 
 
     /**
-        This function computes the overall correlation of the subframes
+        This function computes the overall correlation of the subframes, the first one on the
+        calling thread and the others on the subframe workers
     */
     void computeCorrelation();
     /**
-        This function computes the Subframe correlation measures. It works over
-    Gray coded images.
+        This function searches the motion of a subframe with a strategy. Each strategy starts
+    from a cleared correlation matrix, so its costs and matches are its own.
 
-    @param  index       The index in the 3SS method
+    @param  strategy    The search strategy
     @param  subframe    The subframe being computed
     @param  tm_1        The index of time t-1 in the gray code matrix
-    @note   The correlation relies on some values #defined in the class' header
     */
-    void computeSubframeCorrelation (uint index, uchar subframe, uchar t_m1);
+    void searchSubframe (SearchStrategy strategy, uchar subframe, uchar tm_1);
+
+    /** This function matches every offset of the 2P+1 x 2P+1 window */
+    void searchFull (uchar subframe, uchar tm_1, tcorrMatElement* best);
+    /** This function runs the three step search from the center of the window */
+    void searchThreeStep (uchar subframe, uchar tm_1, tcorrMatElement* best);
+    /** This function runs the diamond search from the center of the window */
+    void searchDiamond (uchar subframe, uchar tm_1, tcorrMatElement* best);
+    /** This function matches every other offset on every other row, then refines around the best */
+    void searchHierarchical (uchar subframe, uchar tm_1, tcorrMatElement* best);
+    /**
+        This function matches a window of PREDICTIVE_RADIUS around the global vector at t-1 and
+    doubles it while the best offset is on its border or differs in more than PREDICTIVE_POOR_COST
+    of the window pixels
+    */
+    void searchPredictive (uchar subframe, uchar tm_1, tcorrMatElement* best);
+    /**
+        This function matches the offsets at a distance of radius from cm,cn, the spiral order
+    finds a low cost early when the motion is close to the previous one
+
+    @param  cm, cn      The center of the ring
+    @param  radius      The distance of its offsets, in the largest of both axes
+    */
+    void searchRing (uchar subframe, uchar tm_1, int cm, int cn, int radius, tcorrMatElement* best);
 
     /**
-    This function computes the full correlation matrix of size 2P+1 x 2P+1
+        Matches an offset once per frame and keeps it if it is better than the best one
 
     @param  subframe    The subframe being computed
     @param  tm_1        The index of time t-1 in the gray code matrix
+    @param  m, n        The offset, ignored outside the search window
+    @param  best        The best offset so far
+    @return True if the offset is the new best one
     */
-    void computeFullCorrelation (uchar subframe, uchar tm_1);
+    bool tryCandidate (uchar subframe, uchar tm_1, int m, int n, tcorrMatElement* best);
 
+    /**
+        Packs the gray code of a subframe window at time t, so every offset compares against it
+
+    @param  subframe    The subframe being computed
+    */
+    void getSubframeWindowBits (uchar subframe);
+
+    /**
+        Chooses the bit plane searched by a subframe, the highest one whose window has edges
+    between at least GRAY_CODE_MIN_TEXTURE of its neighbouring pixels, or else the one with the
+    most edges. Low planes keep the texture of low contrast scenes, high planes are less noisy.
+    The window bits of the chosen plane are left packed.
+
+    @param  subframe    The subframe being computed
+    */
+    void selectSubframePlane (uchar subframe);
+    /** Return the edges between neighbouring pixels of the packed window bits of a subframe */
+    uint getSubframeWindowTexture (uchar subframe);
 
     /**
         Compute single correlation for m,n offset;
+
+    @param  bound       Stops once the cost reaches it if the early termination is enabled
+    @param  rowStep     Compares one row of each rowStep
+    @return False if it stopped early, the value is then a lower bound of the cost
+    */
+    inline bool computeSingleCorrelation (uchar subframe, uchar t_m1, tcorrMatElement *element, uint bound = UINT_MAX, uint rowStep = 1);
+#if USE_OPENCV
+    /**
+        Matches a window of Words words per row, the loops over the words are unrolled. Words 0
+    is the generic match for any width.
     */
-    inline void computeSingleCorrelation (uchar subframe, uchar t_m1, tcorrMatElement *element);
+    template <int Words>
+    inline bool matchWindow (uchar subframe, uchar t_m1, tcorrMatElement *element, uint bound, uint rowStep);
+#endif
 
 
     /**
         This function uses each subframe's minimum and the last motion vector to compute
-        the current motion vector.
+        the current motion vector. They vote, the vector with most votes within VOTE_TOLERANCE
+        wins and the median of its voters is taken, so moving objects only sway their subframes.
     */
     void findMotionVector();
 
     /**
         This function sorts the subframe minima's and the last motion vector into an array
 
-    @param      sortedMinima    The array where the five values will be sorted; Quicksort is used as the
+    @param      sortedMinima    The array where the values will be sorted; Quicksort is used as the
                                 sorting algorithm.
     @param      beg             The beginning index for sorting
     @param      end             The end index for sorting
@@ -272,23 +504,49 @@ private:
     int videoWidth;
     /** Holds the current index of the grayCodeMatrix being used*/
     uchar currentGrayCodeIndex;
-    /** Holds the size of the search window based on the search factor*/
-    const uchar searchFactorWindow;
-    /** Holds the vertical search offset for subframes LR and LL*/
-    const uint vSearchOffset;
-    /** Holds the horizontal search offset for subframes UR and LR*/
-    const uint hSearchOffset;
+    /** Holds the columns and rows of the grid, and its number of subframes */
+    uint gridColumns;
+    uint gridRows;
+    uint subframes;
+    /** Grid and parameters asked with setSubframeGrid() and setParameters(), applied before the next frame */
+    int requestedColumns;
+    int requestedRows;
+    Parameters requestedParameters;
+    bool geometryChanged;
+
+    /** Parameters of the current frame, see Parameters */
+    int searchFactor;
+    uint windowWidth;
+    uint windowHeight;
+    double panFactor;
+    int maxMotionM;
+    int maxMotionN;
 
     /** Holds the location of the ul and lr corners of each subframe*/
-    tSearchWindow subframeLocations[4];
+    tSearchWindow subframeLocations[MAX_SUBFRAMES];
 
     /**
-    This variable is an array of vectors that are in turn videoHeight arrays of QBitArrays that are
-    videoWidth long. They take turns to hold g_k[t] and g_k[t-1]
+    This variable is an array of vectors that are in turn arrays of QBitArrays, or rows of packed
+    words with OpenCV. They take turns to hold g_k[t] and g_k[t-1]
+
+    Each subframe has its own planes, so they are written concurrently. A plane only covers the
+    search area of its subframe, the window grown by P on each side, see grayCodeWidth(). The
+    GRAY_CODE_PLANES bit planes of a subframe follow each other, from GRAY_CODE_FIRST_PLANE.
 
-    @see getGrayCode()
+    @see processSubframe()
     */
-    tGrayCodeMat grayCodeMatrix[2];
+    tGrayCodeMat grayCodeMatrix[2][MAX_SUBFRAMES];
+
+    /** Bit plane searched by each subframe, counted from GRAY_CODE_FIRST_PLANE */
+    uchar subframePlane[MAX_SUBFRAMES];
+
+#if USE_OPENCV
+    /** Words of a row of a subframe plane, with one more so 64 bits can be read from any pixel */
+    uint grayCodeStride;
+
+    /** Gray code of each subframe window at time t, one masked row of words after the other */
+    std::vector<quint64> windowBits[MAX_SUBFRAMES];
+#endif
 
     /**
     This variable holds the image matrix currently being worked on.
@@ -296,18 +554,40 @@ private:
     tImageMat imageMatrix;
 
     /**
-    This variable holds the 27 relevant values of the correlation matrix
-    as defined in the 3SS method
-    */
-    tcorrMatElement correlationMatrix[4][18];
-
-    /**
-    This matrix holds a full blown correlation matrix instead of the 9 points used in the 3SS method
+    This matrix holds the correlation of every offset matched in the current frame, UINT_MAX
+    for the ones not matched. Only sized for the current P, row n + P holds the offsets m of n
     */
-    tcorrMatElement fullCorrelationMatrix[4][2*SEARCH_FACTOR_P+1][2*SEARCH_FACTOR_P+1];
+    std::vector<tcorrMatElement> fullCorrelationMatrix[MAX_SUBFRAMES];
+
+    /** Offsets of the correlation matrix whose match stopped early */
+    std::vector<uchar> partialOffsets[MAX_SUBFRAMES];
+
+    /** Offsets matched by the strategy running on each subframe, and its work */
+    std::vector<uchar> visitedOffsets[MAX_SUBFRAMES];
+    tSearchCounters searchCounters[MAX_SUBFRAMES];
+
+    /** Result and work of each strategy run on each subframe in the current frame */
+    tcorrMatElement strategyMinima[MAX_SUBFRAMES][SearchStrategyCount];
+    tSearchCounters strategyCounters[MAX_SUBFRAMES][SearchStrategyCount];
+
+    /** Guards the settings and statistics shared with the interface */
+    mutable QMutex searchMutex;
+    SearchStrategy strategy;
+    bool evaluation;
+    bool earlyTermination;
+    bool parallelSubframes;
+    /** Settings of the current frame, read by the subframe workers */
+    SearchStrategy activeStrategy;
+    bool evaluating;
+    bool terminating;
+
+    /** Sums of the statistics of each strategy */
+    SearchStatistics statisticsSum[SearchStrategyCount];
+    /** Frames of each strategy compared with the full search */
+    quint64 evaluatedFrames[SearchStrategyCount];
 
     /** This array holds the local minima of each subframe */
-    tcorrMatElement localMinima[4];
+    tcorrMatElement localMinima[MAX_SUBFRAMES];
 
     /** This element contains the motion vector at time t-1*/
     tcorrMatElement vg_tm1;